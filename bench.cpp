@@ -0,0 +1,909 @@
+// Micro-benchmarks for shared_ptr.h. Build with optimizations
+// (-DCMAKE_BUILD_TYPE=Release) and run as
+//
+//     shared_ptr_bench [name-filter]
+//
+// Every benchmark whose name contains the filter is run.
+
+#include "shared_ptr.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+    struct benchmark
+    {
+        char const* name;
+        void (*run)();
+    };
+
+    std::vector<benchmark>& registry()
+    {
+        static std::vector<benchmark> benchmarks;
+        return benchmarks;
+    }
+
+    struct registrar
+    {
+        registrar(char const* name, void (*run)())
+        {
+            registry().push_back({name, run});
+        }
+    };
+
+    // Prevents the optimizer from discarding value or the computation behind it.
+    template <typename T>
+    void do_not_optimize(T const& value)
+    {
+        asm volatile("" : : "r"(&value) : "memory");
+    }
+
+    template <typename F>
+    double ns_per_op(std::size_t iterations, F&& f)
+    {
+        auto start = std::chrono::steady_clock::now();
+        for (std::size_t i = 0; i != iterations; ++i)
+        {
+            f();
+        }
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+        return elapsed.count() / static_cast<double>(iterations);
+    }
+
+    void report(char const* label, double ns)
+    {
+        std::printf("  %-48s %10.2f ns/op\n", label, ns);
+    }
+
+    // 1, 2, 4, ... up to the hardware thread count, but at least up to min_max.
+    std::vector<unsigned> thread_counts(unsigned min_max = 4)
+    {
+        unsigned const max = std::max(std::thread::hardware_concurrency(), min_max);
+        std::vector<unsigned> counts;
+        for (unsigned n = 1; n <= max; n *= 2)
+        {
+            counts.push_back(n);
+        }
+        return counts;
+    }
+
+    // Runs f(thread_index) for iterations on each of threads threads, all
+    // started together. Returns the total throughput in millions of ops/s.
+    template <typename F>
+    double mops_per_sec(unsigned threads, std::size_t iterations, F const& f)
+    {
+        std::atomic<unsigned> ready{0};
+        std::atomic<bool> go{false};
+        std::vector<std::thread> workers;
+        for (unsigned t = 0; t != threads; ++t)
+        {
+            workers.emplace_back([&, t] {
+                ++ready;
+                while (!go.load(std::memory_order_acquire))
+                {
+                    std::this_thread::yield();
+                }
+                for (std::size_t i = 0; i != iterations; ++i)
+                {
+                    f(t);
+                }
+            });
+        }
+        while (ready.load() != threads)
+        {
+            std::this_thread::yield();
+        }
+        auto start = std::chrono::steady_clock::now();
+        go.store(true, std::memory_order_release);
+        for (std::thread& w : workers)
+        {
+            w.join();
+        }
+        std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+        return static_cast<double>(iterations) * threads / elapsed.count();
+    }
+
+    void report_threads(char const* label, unsigned threads, double mops)
+    {
+        std::printf("  %-40s %3u threads %10.2f Mops/s\n", label, threads, mops);
+    }
+
+    // Sorts samples, in nanoseconds, and prints their median and tail.
+    void report_percentiles(char const* label, std::vector<double>& samples)
+    {
+        std::sort(samples.begin(), samples.end());
+        auto at = [&](double q) { return samples[static_cast<std::size_t>(q * static_cast<double>(samples.size() - 1))]; };
+        std::printf("  %-40s p50 %10.0f ns  p99 %10.0f ns  p999 %10.0f ns  max %10.0f ns\n", label, at(0.5), at(0.99),
+                    at(0.999), samples.back());
+    }
+
+    struct base
+    {
+        int value = 0;
+    };
+
+    struct derived : base
+    {
+        int extra = 0;
+    };
+
+    // The control block counts as they were before strong and weak were
+    // packed into one word, kept around as a baseline.
+    struct split_counts
+    {
+        std::atomic<std::size_t> strong{1};
+        std::atomic<std::size_t> weak{1};
+
+        bool try_add_strong() noexcept
+        {
+            std::size_t count = strong.load();
+            while (count != 0)
+            {
+                if (strong.compare_exchange_weak(count, count + 1))
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // Returns true if the caller has to free the block.
+        bool release_strong() noexcept
+        {
+            return --strong == 0 && --weak == 0;
+        }
+    };
+
+    struct split_block
+    {
+        split_counts counts;
+        base object;
+    };
+}
+
+#define BENCHMARK(name)                                          \
+    void bench_##name();                                         \
+    registrar const registrar_##name(#name, &bench_##name);      \
+    void bench_##name()
+
+// Create and drop short-lived objects, so every iteration pays for the
+// final release. std::shared_ptr disposes through a virtual call.
+BENCHMARK(last_release)
+{
+    std::size_t const n = 10'000'000;
+
+    report("shared_ptr<T>(new T)", ns_per_op(n, [] {
+        shared_ptr<base> p(new base());
+        do_not_optimize(p);
+    }));
+    report("shared_ptr<base>(new derived), indirect", ns_per_op(n, [] {
+        shared_ptr<base> p(new derived());
+        do_not_optimize(p);
+    }));
+    report("make_shared<T>", ns_per_op(n, [] {
+        shared_ptr<base> p = make_shared<base>();
+        do_not_optimize(p);
+    }));
+    report("std::shared_ptr<T>(new T)", ns_per_op(n, [] {
+        std::shared_ptr<base> p(new base());
+        do_not_optimize(p);
+    }));
+    report("std::make_shared<T>", ns_per_op(n, [] {
+        std::shared_ptr<base> p = std::make_shared<base>();
+        do_not_optimize(p);
+    }));
+}
+
+// shared_ptr<T>(new T) followed by reset(new T): the control block comes
+// either from operator new or from the calling thread's block_pool.
+BENCHMARK(pooled_blocks)
+{
+    std::size_t const n = 2'000'000;
+
+    for (unsigned threads : thread_counts())
+    {
+        report_threads("shared_ptr(new T), reset(new T)", threads, mops_per_sec(threads, n, [](unsigned) {
+            shared_ptr<base> p(new base());
+            p.reset(new base());
+            do_not_optimize(p);
+        }));
+        report_threads("pooled shared_ptr(new T), reset(new T)", threads, mops_per_sec(threads, n, [](unsigned) {
+            shared_ptr<base> p(new base(), std::default_delete<base>(), pool_allocator<base>());
+            p.reset(new base(), std::default_delete<base>(), pool_allocator<base>());
+            do_not_optimize(p);
+        }));
+    }
+}
+
+// Shared I/O buffers from 4 KB to 64 MB that are filled right after
+// allocation. make_shared zeroes the buffer first, which doubles the memory
+// traffic and faults in fresh pages early.
+BENCHMARK(buffer_allocation)
+{
+    for (std::size_t size = 4 << 10; size <= 64 << 20; size *= 4)
+    {
+        std::size_t const n = std::max<std::size_t>(4, (256 << 20) / size);
+        char label[64];
+
+        std::snprintf(label, sizeof label, "make_shared<char[]>, %zu KB", size >> 10);
+        report(label, ns_per_op(n, [size] {
+            shared_ptr<char[]> p = make_shared<char[]>(size);
+            std::memset(p.get(), 0x5a, size);
+            do_not_optimize(p);
+        }));
+
+        std::snprintf(label, sizeof label, "make_shared_for_overwrite<char[]>, %zu KB", size >> 10);
+        report(label, ns_per_op(n, [size] {
+            shared_ptr<char[]> p = make_shared_for_overwrite<char[]>(size);
+            std::memset(p.get(), 0x5a, size);
+            do_not_optimize(p);
+        }));
+    }
+}
+
+// Every thread copies and drops its own object, but the objects were
+// created back to back, so with the packed layout their counters share
+// cache lines.
+BENCHMARK(false_sharing)
+{
+    std::size_t const n = 2'000'000;
+
+    for (unsigned threads : thread_counts())
+    {
+        std::vector<shared_ptr<base>> packed;
+        std::vector<shared_ptr<base>> isolated;
+        for (unsigned t = 0; t != threads; ++t)
+        {
+            packed.push_back(make_shared<base>());
+        }
+        for (unsigned t = 0; t != threads; ++t)
+        {
+            isolated.push_back(make_shared<base>(cache_line_isolated));
+        }
+
+        report_threads("make_shared, copy + release", threads, mops_per_sec(threads, n, [&](unsigned t) {
+            shared_ptr<base> copy = packed[t];
+            do_not_optimize(copy);
+        }));
+        report_threads("make_shared isolated, copy + release", threads, mops_per_sec(threads, n, [&](unsigned t) {
+            shared_ptr<base> copy = isolated[t];
+            do_not_optimize(copy);
+        }));
+    }
+}
+
+// weak_ptr::lock() followed by the release of the locked pointer, all
+// threads on the same object, next to the same two steps done with separate
+// strong and weak counters. The single-threaded make + release rows show the
+// last-release path, which the packed word finishes with one RMW.
+BENCHMARK(counter_layout)
+{
+    std::size_t const n = 2'000'000;
+
+    report("make_shared<T>, release", ns_per_op(n * 5, [] {
+        shared_ptr<base> p = make_shared<base>();
+        do_not_optimize(p);
+    }));
+    report("split counts: new block, release", ns_per_op(n * 5, [] {
+        split_block* b = new split_block();
+        do_not_optimize(b);
+        if (b->counts.release_strong())
+        {
+            delete b;
+        }
+    }));
+
+    for (unsigned threads : thread_counts())
+    {
+        shared_ptr<base> owner = make_shared<base>();
+        weak_ptr<base> weak = owner;
+        split_counts split;
+        std::shared_ptr<base> std_owner = std::make_shared<base>();
+        std::weak_ptr<base> std_weak = std_owner;
+
+        report_threads("weak_ptr::lock + release", threads, mops_per_sec(threads, n, [&](unsigned) {
+            shared_ptr<base> p = weak.lock();
+            do_not_optimize(p);
+        }));
+        report_threads("split counts: lock + release", threads, mops_per_sec(threads, n, [&](unsigned) {
+            bool locked = split.try_add_strong();
+            do_not_optimize(locked);
+            split.release_strong();
+        }));
+        report_threads("std::weak_ptr::lock + release", threads, mops_per_sec(threads, n, [&](unsigned) {
+            std::shared_ptr<base> p = std_weak.lock();
+            do_not_optimize(p);
+        }));
+    }
+}
+
+// The same single-threaded operations under both counting policies.
+template <typename Policy>
+void bench_policy(char const* name)
+{
+    std::size_t const n = 20'000'000;
+    char label[64];
+
+    shared_ptr<base, Policy> p = make_shared<base, Policy>();
+    weak_ptr<base, Policy> w = p;
+
+    std::snprintf(label, sizeof label, "%s: copy + release", name);
+    report(label, ns_per_op(n, [&] {
+        shared_ptr<base, Policy> copy = p;
+        do_not_optimize(copy);
+    }));
+
+    std::snprintf(label, sizeof label, "%s: reset(make_shared)", name);
+    shared_ptr<base, Policy> q;
+    report(label, ns_per_op(n / 4, [&] {
+        q = make_shared<base, Policy>();
+        do_not_optimize(q);
+    }));
+
+    std::snprintf(label, sizeof label, "%s: weak_ptr::lock + release", name);
+    report(label, ns_per_op(n, [&] {
+        shared_ptr<base, Policy> locked = w.lock();
+        do_not_optimize(locked);
+    }));
+}
+
+BENCHMARK(counting_policy)
+{
+    bench_policy<multi_thread_policy>("multi_thread_policy");
+    bench_policy<single_thread_policy>("single_thread_policy");
+}
+
+// Observers locking one object from every thread, while it is alive and
+// after it expired.
+template <typename Policy>
+void bench_weak_lock(char const* name)
+{
+    std::size_t const n = 2'000'000;
+    char label[64];
+
+    for (unsigned threads : thread_counts())
+    {
+        shared_ptr<base, Policy> owner = make_shared<base, Policy>();
+        weak_ptr<base, Policy> weak = owner;
+
+        std::snprintf(label, sizeof label, "%s: lock + release", name);
+        report_threads(label, threads, mops_per_sec(threads, n, [&](unsigned) {
+            shared_ptr<base, Policy> p = weak.lock();
+            do_not_optimize(p);
+        }));
+
+        owner.reset();
+        std::snprintf(label, sizeof label, "%s: lock expired", name);
+        report_threads(label, threads, mops_per_sec(threads, n, [&](unsigned) {
+            shared_ptr<base, Policy> p = weak.lock();
+            do_not_optimize(p);
+        }));
+    }
+}
+
+BENCHMARK(weak_lock_contention)
+{
+    bench_weak_lock<multi_thread_policy>("multi_thread_policy");
+    bench_weak_lock<biased_policy>("biased_policy");
+
+    for (unsigned threads : thread_counts())
+    {
+        std::shared_ptr<base> owner = std::make_shared<base>();
+        std::weak_ptr<base> weak = owner;
+        report_threads("std::weak_ptr: lock + release", threads, mops_per_sec(threads, 2'000'000, [&](unsigned) {
+            std::shared_ptr<base> p = weak.lock();
+            do_not_optimize(p);
+        }));
+    }
+}
+
+// Every thread creates one object, then copies and drops objects: its own
+// on own_percent of the iterations, the next thread's on the rest.
+template <typename Policy>
+double owner_mix_mops(unsigned threads, std::size_t iterations, unsigned own_percent)
+{
+    std::vector<shared_ptr<base, Policy>> objects(threads);
+    std::atomic<unsigned> ready{0};
+    std::atomic<unsigned> finished{0};
+    std::atomic<bool> go{false};
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t != threads; ++t)
+    {
+        workers.emplace_back([&, t] {
+            objects[t] = make_shared<base, Policy>();
+            ++ready;
+            while (!go.load(std::memory_order_acquire))
+            {
+                std::this_thread::yield();
+            }
+            shared_ptr<base, Policy> const& own = objects[t];
+            shared_ptr<base, Policy> const& other = objects[(t + 1) % threads];
+            for (std::size_t i = 0; i != iterations; ++i)
+            {
+                shared_ptr<base, Policy> copy = i % 100 < own_percent ? own : other;
+                do_not_optimize(copy);
+            }
+            // The owner stays around until nobody copies its object.
+            ++finished;
+            while (finished.load() != threads)
+            {
+                std::this_thread::yield();
+            }
+        });
+    }
+    while (ready.load() != threads)
+    {
+        std::this_thread::yield();
+    }
+    auto start = std::chrono::steady_clock::now();
+    go.store(true, std::memory_order_release);
+    for (std::thread& w : workers)
+    {
+        w.join();
+    }
+    std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+    return static_cast<double>(iterations) * threads / elapsed.count();
+}
+
+// Copies of objects created on the copying thread, and of objects that
+// other threads created.
+BENCHMARK(biased_counts)
+{
+    std::size_t const n = 5'000'000;
+
+    for (unsigned threads : thread_counts())
+    {
+        for (unsigned own_percent : {100u, 90u, 50u, 0u})
+        {
+            char label[64];
+            std::snprintf(label, sizeof label, "multi_thread_policy, %u%% own", own_percent);
+            report_threads(label, threads, owner_mix_mops<multi_thread_policy>(threads, n, own_percent));
+            std::snprintf(label, sizeof label, "biased_policy, %u%% own", own_percent);
+            report_threads(label, threads, owner_mix_mops<biased_policy>(threads, n, own_percent));
+        }
+    }
+}
+
+// Readers loading a value published through one cell, from 1 to 64 threads,
+// alone and while thread 0 keeps replacing it. std::atomic_load on a
+// std::shared_ptr takes one of a few global mutexes.
+BENCHMARK(atomic_load_scaling)
+{
+    std::size_t const n = 200'000;
+    using value = shared_ptr<base, multi_thread_policy>;
+
+    for (unsigned threads : thread_counts(64))
+    {
+        atomic_shared_ptr<base> cell(make_shared<base, multi_thread_policy>());
+        report_threads("atomic_shared_ptr: load + release", threads, mops_per_sec(threads, n, [&](unsigned) {
+            value p = cell.load();
+            do_not_optimize(p);
+        }));
+        report_threads("atomic_shared_ptr: load, one writer", threads, mops_per_sec(threads, n, [&](unsigned t) {
+            if (t == 0)
+            {
+                cell.store(make_shared<base, multi_thread_policy>());
+            }
+            value p = cell.load();
+            do_not_optimize(p);
+        }));
+
+        std::shared_ptr<base> std_cell = std::make_shared<base>();
+        report_threads("std::atomic_load + release", threads, mops_per_sec(threads, n, [&](unsigned) {
+            std::shared_ptr<base> p = std::atomic_load(&std_cell);
+            do_not_optimize(p);
+        }));
+        report_threads("std::atomic_load, one writer", threads, mops_per_sec(threads, n, [&](unsigned t) {
+            if (t == 0)
+            {
+                std::atomic_store(&std_cell, std::make_shared<base>());
+            }
+            std::shared_ptr<base> p = std::atomic_load(&std_cell);
+            do_not_optimize(p);
+        }));
+    }
+}
+
+// Readers of one published value that copy a shared_ptr to it, against
+// readers that protect it with a hazard pointer and never write to its
+// block.
+BENCHMARK(hazard_reads)
+{
+    std::size_t const n = 200'000;
+    using value = shared_ptr<base, multi_thread_policy>;
+
+    for (unsigned threads : thread_counts(64))
+    {
+        value const shared = make_shared<base, multi_thread_policy>();
+        report_threads("shared_ptr: copy + release", threads, mops_per_sec(threads, n, [&](unsigned) {
+            value p = shared;
+            do_not_optimize(p->value);
+        }));
+
+        atomic_shared_ptr<base, hazard_reclaim> cell(make_shared<base, multi_thread_policy>());
+        report_threads("atomic_shared_ptr: load + release", threads, mops_per_sec(threads, n, [&](unsigned) {
+            value p = cell.load();
+            do_not_optimize(p->value);
+        }));
+        report_threads("hazard_pointer: protect", threads, mops_per_sec(threads, n, [&](unsigned) {
+            thread_local hazard_pointer hazard;
+            do_not_optimize(hazard.protect(cell)->value);
+        }));
+        report_threads("hazard_pointer: protect, one writer", threads, mops_per_sec(threads, n, [&](unsigned t) {
+            thread_local hazard_pointer hazard;
+            if (t == 0)
+            {
+                cell.store(make_shared<base, multi_thread_policy>());
+            }
+            do_not_optimize(hazard.protect(cell)->value);
+        }));
+    }
+}
+
+// Read-mostly mix: thread 0 publishes a new value every 10000 reads, every
+// thread reads through rcu_cell, atomic_shared_ptr, a hazard pointer or
+// std::atomic_load.
+BENCHMARK(rcu_read_mostly)
+{
+    std::size_t const n = 200'000;
+    std::size_t const writes_every = 10'000;
+    using value = shared_ptr<base, multi_thread_policy>;
+
+    for (unsigned threads : thread_counts(64))
+    {
+        rcu_cell<base> rcu(make_shared<base const, multi_thread_policy>());
+        report_threads("rcu_cell: read", threads, mops_per_sec(threads, n, [&](unsigned t) {
+            thread_local std::size_t i = 0;
+            if (t == 0 && ++i % writes_every == 0)
+            {
+                rcu.store(make_shared<base const, multi_thread_policy>());
+            }
+            rcu_read_guard guard;
+            do_not_optimize(rcu.read(guard)->value);
+        }));
+
+        atomic_shared_ptr<base> cell(make_shared<base, multi_thread_policy>());
+        report_threads("atomic_shared_ptr: load", threads, mops_per_sec(threads, n, [&](unsigned t) {
+            thread_local std::size_t i = 0;
+            if (t == 0 && ++i % writes_every == 0)
+            {
+                cell.store(make_shared<base, multi_thread_policy>());
+            }
+            value p = cell.load();
+            do_not_optimize(p->value);
+        }));
+
+        atomic_shared_ptr<base, hazard_reclaim> hazard_cell(make_shared<base, multi_thread_policy>());
+        report_threads("hazard_pointer: protect", threads, mops_per_sec(threads, n, [&](unsigned t) {
+            thread_local std::size_t i = 0;
+            thread_local hazard_pointer hazard;
+            if (t == 0 && ++i % writes_every == 0)
+            {
+                hazard_cell.store(make_shared<base, multi_thread_policy>());
+            }
+            do_not_optimize(hazard.protect(hazard_cell)->value);
+        }));
+
+        std::shared_ptr<base> std_cell = std::make_shared<base>();
+        report_threads("std::atomic_load", threads, mops_per_sec(threads, n, [&](unsigned t) {
+            thread_local std::size_t i = 0;
+            if (t == 0 && ++i % writes_every == 0)
+            {
+                std::atomic_store(&std_cell, std::make_shared<base>());
+            }
+            std::shared_ptr<base> p = std::atomic_load(&std_cell);
+            do_not_optimize(p->value);
+        }));
+    }
+}
+
+// Every thread copies and drops the same global object, like a logger
+// fetched on every request: one shared count against sharded_policy.
+BENCHMARK(hot_object_copies)
+{
+    std::size_t const n = 1'000'000;
+
+    for (unsigned threads : thread_counts(64))
+    {
+        shared_ptr<base, multi_thread_policy> shared = make_shared<base, multi_thread_policy>();
+        report_threads("multi_thread_policy: copy + release", threads, mops_per_sec(threads, n, [&](unsigned) {
+            shared_ptr<base, multi_thread_policy> copy = shared;
+            do_not_optimize(copy);
+        }));
+
+        hot_shared_ptr<base> hot = make_shared<base, sharded_policy>();
+        report_threads("sharded_policy: copy + release", threads, mops_per_sec(threads, n, [&](unsigned) {
+            hot_shared_ptr<base> copy = hot;
+            do_not_optimize(copy);
+        }));
+        sharded_policy::collapse(hot);
+    }
+}
+
+// Lookups in an index slot replaced by thread 0 every 100 operations: a
+// guard per lookup and per 16 lookups against a hazard pointer per lookup,
+// which also means scanning its records on retire.
+BENCHMARK(ebr_reads)
+{
+    std::size_t const n = 1'000'000;
+    std::size_t const writes_every = 100;
+
+    for (unsigned threads : thread_counts(64))
+    {
+        atomic_shared_ptr<base, ebr_reclaim> ebr_cell(make_shared<base, multi_thread_policy>());
+        report_threads("ebr_guard per read", threads, mops_per_sec(threads, n, [&](unsigned t) {
+            thread_local std::size_t i = 0;
+            if (t == 0 && ++i % writes_every == 0)
+            {
+                ebr_cell.store(make_shared<base, multi_thread_policy>());
+            }
+            ebr_guard guard;
+            do_not_optimize(guard.protect(ebr_cell)->value);
+        }));
+        report_threads("ebr_guard per 16 reads", threads, mops_per_sec(threads, n / 16, [&](unsigned t) {
+            thread_local std::size_t i = 0;
+            ebr_guard guard;
+            for (int j = 0; j != 16; ++j)
+            {
+                if (t == 0 && ++i % writes_every == 0)
+                {
+                    ebr_cell.store(make_shared<base, multi_thread_policy>());
+                }
+                do_not_optimize(guard.protect(ebr_cell)->value);
+            }
+        }) * 16);
+        ebr_domain::global().reclaim();
+
+        atomic_shared_ptr<base, hazard_reclaim> hazard_cell(make_shared<base, multi_thread_policy>());
+        report_threads("hazard_pointer per read", threads, mops_per_sec(threads, n, [&](unsigned t) {
+            thread_local std::size_t i = 0;
+            thread_local hazard_pointer hazard;
+            if (t == 0 && ++i % writes_every == 0)
+            {
+                hazard_cell.store(make_shared<base, multi_thread_policy>());
+            }
+            do_not_optimize(hazard.protect(hazard_cell)->value);
+        }));
+        hazard_domain::global().reclaim();
+    }
+}
+
+// A snapshot read by every thread and replaced by thread 0 every 1000
+// reads: one field through seqlock_shared_cell::read, against a copy of
+// the shared_ptr from atomic_shared_ptr::load.
+BENCHMARK(seqlock_snapshot)
+{
+    std::size_t const n = 1'000'000;
+    std::size_t const writes_every = 1'000;
+
+    struct snapshot
+    {
+        std::int64_t bid = 0;
+        std::int64_t ask = 0;
+        std::int64_t volume = 0;
+    };
+    using value = shared_ptr<snapshot const, multi_thread_policy>;
+
+    for (unsigned threads : thread_counts(64))
+    {
+        seqlock_shared_cell<snapshot> seqlock(make_shared<snapshot const, multi_thread_policy>());
+        report_threads("seqlock_shared_cell: read", threads, mops_per_sec(threads, n, [&](unsigned t) {
+            thread_local std::size_t i = 0;
+            if (t == 0 && ++i % writes_every == 0)
+            {
+                seqlock.store(make_shared<snapshot const, multi_thread_policy>());
+            }
+            do_not_optimize(seqlock.read([](snapshot const& s) { return s.bid; }));
+        }));
+
+        atomic_shared_ptr<snapshot const> cell(make_shared<snapshot const, multi_thread_policy>());
+        report_threads("atomic_shared_ptr: load", threads, mops_per_sec(threads, n, [&](unsigned t) {
+            thread_local std::size_t i = 0;
+            if (t == 0 && ++i % writes_every == 0)
+            {
+                cell.store(make_shared<snapshot const, multi_thread_policy>());
+            }
+            value p = cell.load();
+            do_not_optimize(p->bid);
+        }));
+    }
+}
+
+// Each thread fills a vector of records with references to 8 shared
+// dictionaries and drops them all, one release per pointer or grouped by
+// a release_batch. Throughput counts pointers copied in and dropped. The
+// first two lines show what checking for a batch costs every release
+// outside of one.
+BENCHMARK(batched_releases)
+{
+    std::size_t const n = 200;
+    std::size_t const records = 1'000;
+    using value = shared_ptr<base, batched_policy>;
+
+    shared_ptr<base, multi_thread_policy> plain = make_shared<base, multi_thread_policy>();
+    report("multi_thread_policy: copy + release", ns_per_op(20'000'000, [&] {
+        shared_ptr<base, multi_thread_policy> copy = plain;
+        do_not_optimize(copy);
+    }));
+    value batchable = make_shared<base, batched_policy>();
+    report("batched_policy: copy + release", ns_per_op(20'000'000, [&] {
+        value copy = batchable;
+        do_not_optimize(copy);
+    }));
+
+    std::vector<value> dictionaries;
+    for (int i = 0; i != 8; ++i)
+    {
+        dictionaries.push_back(make_shared<base, batched_policy>());
+    }
+    auto fill = [&](std::vector<value>& v) {
+        for (std::size_t i = 0; i != records; ++i)
+        {
+            v.push_back(dictionaries[i % dictionaries.size()]);
+        }
+    };
+
+    for (unsigned threads : thread_counts(8))
+    {
+        report_threads("release one by one", threads, records * mops_per_sec(threads, n, [&](unsigned) {
+            thread_local std::vector<value> v;
+            fill(v);
+            v.clear();
+        }));
+        report_threads("release_batch", threads, records * mops_per_sec(threads, n, [&](unsigned) {
+            thread_local std::vector<value> v;
+            fill(v);
+            release_batch batch;
+            v.clear();
+        }));
+    }
+}
+
+// Latency of dropping the last reference to a document of 10000 separately
+// allocated nodes, inline and through deferred_policy. Building the next
+// document, which is not timed, gives the reclaimer time to catch up.
+// Deferral only pays off with a core to spare for the reclaimer; on a
+// single core it preempts the thread that woke it.
+BENCHMARK(deferred_release)
+{
+    std::size_t const samples = 2'000;
+    std::size_t const nodes = 10'000;
+
+    struct document
+    {
+        std::vector<std::unique_ptr<base>> nodes;
+    };
+
+    auto build = [&] {
+        document d;
+        d.nodes.reserve(nodes);
+        for (std::size_t i = 0; i != nodes; ++i)
+        {
+            d.nodes.push_back(std::make_unique<base>());
+        }
+        return d;
+    };
+
+    auto measure = [&](auto make) {
+        std::vector<double> ns;
+        ns.reserve(samples);
+        for (std::size_t i = 0; i != samples; ++i)
+        {
+            auto p = make(build());
+            auto start = std::chrono::steady_clock::now();
+            p.reset();
+            std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+            ns.push_back(elapsed.count());
+        }
+        return ns;
+    };
+
+    std::vector<double> inline_ns = measure([](document d) {
+        return make_shared<document, multi_thread_policy>(std::move(d));
+    });
+    report_percentiles("multi_thread_policy: reset", inline_ns);
+
+    std::vector<double> deferred_ns = measure([](document d) {
+        return make_shared<document, deferred_policy>(std::move(d));
+    });
+    deferred_policy::drain();
+    report_percentiles("deferred_policy: reset", deferred_ns);
+}
+
+namespace
+{
+    // Each thread works on its own handles to 4 shared objects: copy and
+    // drop, move, assign and reset, lock a weak_ptr, and a random mix of
+    // all of them. The object and its block are what the threads share.
+    template <typename Strong, typename Weak, typename Make>
+    void ownership_scaling(char const* name, Make make)
+    {
+        std::size_t const n = 500'000;
+
+        std::vector<Strong> owners;
+        std::vector<Weak> watchers;
+        for (int i = 0; i != 4; ++i)
+        {
+            owners.push_back(make());
+            watchers.push_back(owners.back());
+        }
+        auto label = [name](char const* op) { return std::string(name) + ": " + op; };
+
+        for (unsigned threads : thread_counts())
+        {
+            report_threads(label("copy").c_str(), threads, mops_per_sec(threads, n, [&](unsigned t) {
+                Strong copy = owners[t % 4];
+                do_not_optimize(copy);
+            }));
+            report_threads(label("copy + move").c_str(), threads, mops_per_sec(threads, n, [&](unsigned t) {
+                Strong copy = owners[t % 4];
+                Strong moved = std::move(copy);
+                do_not_optimize(moved);
+            }));
+            report_threads(label("assign + reset").c_str(), threads, mops_per_sec(threads, n, [&](unsigned t) {
+                thread_local Strong slot;
+                slot = owners[t % 4];
+                slot.reset();
+            }));
+            report_threads(label("weak lock").c_str(), threads, mops_per_sec(threads, n, [&](unsigned t) {
+                Strong locked = watchers[t % 4].lock();
+                do_not_optimize(locked);
+            }));
+            report_threads(label("mixed").c_str(), threads, mops_per_sec(threads, n, [&](unsigned t) {
+                thread_local std::uint32_t random = t + 1;
+                thread_local Strong slots[2];
+                random = random * 1664525u + 1013904223u;
+                Strong& slot = slots[(random >> 8) & 1];
+                switch ((random >> 12) % 4)
+                {
+                case 0:
+                    slot = owners[(random >> 16) % 4];
+                    break;
+                case 1:
+                    slot = std::move(slots[!((random >> 8) & 1)]);
+                    break;
+                case 2:
+                    slot.reset();
+                    break;
+                default:
+                    slot = watchers[(random >> 16) % 4].lock();
+                    break;
+                }
+            }));
+        }
+    }
+}
+
+// Scaling of the basic ownership operations on shared objects, from one
+// thread up to the hardware thread count, to find where each policy stops
+// scaling.
+BENCHMARK(ownership_scaling)
+{
+    ownership_scaling<shared_ptr<base, multi_thread_policy>, weak_ptr<base, multi_thread_policy>>(
+        "multi_thread_policy", [] { return make_shared<base, multi_thread_policy>(); });
+    ownership_scaling<shared_ptr<base, biased_policy>, weak_ptr<base, biased_policy>>(
+        "biased_policy", [] { return make_shared<base, biased_policy>(); });
+    ownership_scaling<std::shared_ptr<base>, std::weak_ptr<base>>("std::shared_ptr",
+                                                                  [] { return std::make_shared<base>(); });
+}
+
+int main(int argc, char** argv)
+{
+    char const* filter = argc > 1 ? argv[1] : "";
+    for (benchmark const& b : registry())
+    {
+        if (std::strstr(b.name, filter))
+        {
+            std::printf("%s\n", b.name);
+            b.run();
+        }
+    }
+}
@@ -2,6 +2,154 @@
 #include "shared_ptr.h"
 #include "test_object.h"
 
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <new>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace
+{
+    std::atomic<std::size_t> allocations{0};
+    std::atomic<std::size_t> deallocations{0};
+    // Set by failing_allocations, for the calling thread only.
+    thread_local bool allocations_fail = false;
+}
+
+// Out of line so GCC does not pair the inlined malloc with operator delete.
+[[gnu::noinline]] void* operator new(std::size_t size)
+{
+    if (allocations_fail)
+    {
+        throw std::bad_alloc();
+    }
+    ++allocations;
+    if (void* p = std::malloc(size != 0 ? size : 1))
+    {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+    if (p)
+    {
+        ++deallocations;
+    }
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+    if (p)
+    {
+        ++deallocations;
+    }
+    std::free(p);
+}
+
+struct allocation_counter
+{
+    allocation_counter()
+    {
+#ifdef SHARED_PTR_BIASED
+        // The thread's first biased block would also allocate its owner
+        // record; make it before counting, so that tests see the block's.
+        biased_policy::attach();
+#endif
+        old_allocations = ::allocations;
+        old_deallocations = ::deallocations;
+    }
+
+    std::size_t allocations() const
+    {
+        return ::allocations - old_allocations;
+    }
+
+    std::size_t deallocations() const
+    {
+        return ::deallocations - old_deallocations;
+    }
+
+private:
+    std::size_t old_allocations;
+    std::size_t old_deallocations;
+};
+
+// Makes operator new throw on the calling thread while it lives.
+struct failing_allocations
+{
+    failing_allocations()
+    {
+        allocations_fail = true;
+    }
+
+    failing_allocations(failing_allocations const&) = delete;
+    failing_allocations& operator=(failing_allocations const&) = delete;
+
+    ~failing_allocations()
+    {
+        allocations_fail = false;
+    }
+};
+
+template <typename T>
+struct counting_allocator
+{
+    using value_type = T;
+
+    counting_allocator(std::size_t* allocated, std::size_t* deallocated)
+        : allocated(allocated)
+        , deallocated(deallocated)
+    {}
+
+    template <typename U>
+    counting_allocator(counting_allocator<U> const& other)
+        : allocated(other.allocated)
+        , deallocated(other.deallocated)
+    {}
+
+    T* allocate(std::size_t n)
+    {
+        ++*allocated;
+        void* p = alignof(T) > alignof(std::max_align_t) ? std::aligned_alloc(alignof(T), n * sizeof(T))
+                                                          : std::malloc(n * sizeof(T));
+        if (p)
+        {
+            return static_cast<T*>(p);
+        }
+        throw std::bad_alloc();
+    }
+
+    void deallocate(T* p, std::size_t)
+    {
+        ++*deallocated;
+        std::free(p);
+    }
+
+    template <typename U>
+    bool operator==(counting_allocator<U> const& other) const
+    {
+        return allocated == other.allocated && deallocated == other.deallocated;
+    }
+
+    template <typename U>
+    bool operator!=(counting_allocator<U> const& other) const
+    {
+        return !(*this == other);
+    }
+
+private:
+    template <typename U>
+    friend struct counting_allocator;
+
+    std::size_t* allocated;
+    std::size_t* deallocated;
+};
+
 template <typename T>
 struct custom_deleter
 {
@@ -19,6 +167,30 @@ private:
     bool* deleted;
 };
 
+namespace
+{
+    auto stateless_lambda = [](test_object* object) { delete object; };
+
+    void delete_test_object(test_object* object)
+    {
+        delete object;
+    }
+
+    template <typename D, typename A = std::allocator<test_object>>
+    constexpr std::size_t ptr_block_size = sizeof(detail::ptr_block<test_object, D, A, detail::default_policy>);
+
+    // The object pointer is kept in the common control_block part.
+    constexpr std::size_t ptr_block_header = sizeof(detail::control_block<detail::default_policy>);
+
+    // Stateless deleters and allocators don't grow the control block,
+    // stateful ones cost exactly their size.
+    static_assert(ptr_block_size<std::default_delete<test_object>> == ptr_block_header);
+    static_assert(ptr_block_size<decltype(stateless_lambda)> == ptr_block_header);
+    static_assert(ptr_block_size<custom_deleter<test_object>> ==
+                  ptr_block_header + sizeof(custom_deleter<test_object>));
+    static_assert(ptr_block_size<void (*)(test_object*)> == ptr_block_header + sizeof(void (*)(test_object*)));
+}
+
 struct base
 {};
 
@@ -479,6 +651,157 @@ TEST(shared_ptr_testing, weak_ptr_move_assignment_operator_self_nullptr)
     EXPECT_FALSE(static_cast<bool>(q.lock()));
 }
 
+TEST(shared_ptr_testing, weak_ptr_counts)
+{
+    test_object::no_new_instances_guard g;
+    shared_ptr<test_object> p = make_shared<test_object>(42);
+    std::vector<weak_ptr<test_object>> weak(3, p);
+    shared_ptr<test_object> q = weak[0].lock();
+    EXPECT_EQ(2, p.use_count());
+
+    weak.pop_back();
+    p.reset();
+    EXPECT_EQ(1, q.use_count());
+    q.reset();
+    g.expect_no_instances();
+    EXPECT_TRUE(weak[0].expired());
+    EXPECT_FALSE(static_cast<bool>(weak[1].lock()));
+}
+
+TEST(shared_ptr_testing, last_release_without_weak_ptr)
+{
+    allocation_counter c;
+    bool deleted = false;
+    {
+        shared_ptr<derived> p = make_shared<derived>(&deleted);
+        shared_ptr<derived> q = p;
+    }
+    EXPECT_TRUE(deleted);
+    EXPECT_EQ(1u, c.allocations());
+    EXPECT_EQ(1u, c.deallocations());
+}
+
+namespace
+{
+    // Rounds of threads that copy, reset and lock one object, while the
+    // owner lets go right away: the last reference is dropped on a worker,
+    // racing with the others' locks. test_object reports any access to a
+    // destroyed instance.
+    template <typename Policy>
+    void hammer_copy_reset_lock()
+    {
+        test_object::no_new_instances_guard g;
+        int const threads = 4;
+        for (int round = 0; round != 100; ++round)
+        {
+            shared_ptr<test_object, Policy> p = make_shared<test_object, Policy>(round);
+            weak_ptr<test_object, Policy> w = p;
+            std::vector<std::thread> workers;
+            for (int t = 0; t != threads; ++t)
+            {
+                workers.emplace_back([q = p, w, round]() mutable {
+                    for (int i = 0; i != 200; ++i)
+                    {
+                        shared_ptr<test_object, Policy> copy = q;
+                        EXPECT_EQ(round, *copy);
+                        copy.reset();
+                        if (shared_ptr<test_object, Policy> locked = w.lock())
+                        {
+                            EXPECT_EQ(round, *locked);
+                        }
+                    }
+                    q.reset();
+                    for (int i = 0; i != 200; ++i)
+                    {
+                        if (shared_ptr<test_object, Policy> locked = w.lock())
+                        {
+                            EXPECT_EQ(round, *locked);
+                        }
+                    }
+                });
+            }
+            p.reset();
+            for (std::thread& worker : workers)
+            {
+                worker.join();
+            }
+            biased_policy::drain();
+            EXPECT_TRUE(w.expired());
+        }
+    }
+}
+
+TEST(shared_ptr_testing, concurrent_copy_reset_lock)
+{
+    hammer_copy_reset_lock<multi_thread_policy>();
+}
+
+TEST(shared_ptr_testing, biased_concurrent_copy_reset_lock)
+{
+    hammer_copy_reset_lock<biased_policy>();
+}
+
+namespace
+{
+    // Threads keep locking a weak_ptr while the only shared_ptr is reset.
+    // Once a lock failed, no later lock may succeed.
+    template <typename Policy>
+    void race_lock_with_last_reset()
+    {
+        test_object::no_new_instances_guard g;
+        int const threads = 4;
+        for (int round = 0; round != 200; ++round)
+        {
+            shared_ptr<test_object, Policy> p = make_shared<test_object, Policy>(round);
+            weak_ptr<test_object, Policy> w = p;
+            std::atomic<int> started{0};
+            std::vector<std::thread> lockers;
+            for (int t = 0; t != threads; ++t)
+            {
+                lockers.emplace_back([&w, &started, round] {
+                    ++started;
+                    bool expired = false;
+                    for (int i = 0; i != 1000; ++i)
+                    {
+                        shared_ptr<test_object, Policy> locked = w.lock();
+                        if (locked)
+                        {
+                            EXPECT_FALSE(expired);
+                            EXPECT_EQ(round, *locked);
+                        }
+                        else
+                        {
+                            expired = true;
+                        }
+                    }
+                });
+            }
+            while (started.load() != threads)
+            {
+                std::this_thread::yield();
+            }
+            p.reset();
+            for (std::thread& locker : lockers)
+            {
+                locker.join();
+            }
+            biased_policy::drain();
+            EXPECT_TRUE(w.expired());
+            EXPECT_FALSE(static_cast<bool>(w.lock()));
+        }
+    }
+}
+
+TEST(shared_ptr_testing, weak_ptr_lock_races_last_reset)
+{
+    race_lock_with_last_reset<multi_thread_policy>();
+}
+
+TEST(shared_ptr_testing, biased_weak_ptr_lock_races_last_reset)
+{
+    race_lock_with_last_reset<biased_policy>();
+}
+
 TEST(shared_ptr_testing, custom_deleter)
 {
     test_object::no_new_instances_guard g;
@@ -500,6 +823,27 @@ TEST(shared_ptr_testing, custom_deleter_reset)
     EXPECT_TRUE(deleted);
 }
 
+TEST(shared_ptr_testing, stateless_deleter)
+{
+    test_object::no_new_instances_guard g;
+    {
+        shared_ptr<test_object> p(new test_object(42), stateless_lambda);
+        EXPECT_EQ(42, *p);
+    }
+    g.expect_no_instances();
+}
+
+TEST(shared_ptr_testing, function_pointer_deleter_reset)
+{
+    test_object::no_new_instances_guard g;
+    {
+        shared_ptr<test_object> p;
+        p.reset(new test_object(42), &delete_test_object);
+        EXPECT_EQ(42, *p);
+    }
+    g.expect_no_instances();
+}
+
 TEST(shared_ptr_testing, make_shared)
 {
     test_object::no_new_instances_guard g;
@@ -518,6 +862,247 @@ TEST(shared_ptr_testing, make_shared_weak_ptr)
     g.expect_no_instances();
 }
 
+TEST(shared_ptr_testing, make_shared_single_allocation)
+{
+    allocation_counter c;
+    bool deleted = false;
+    weak_ptr<derived> q;
+    {
+        shared_ptr<derived> p = make_shared<derived>(&deleted);
+        EXPECT_EQ(1u, c.allocations());
+        q = p;
+    }
+    EXPECT_TRUE(deleted);
+    EXPECT_EQ(0u, c.deallocations());
+    q.reset();
+    EXPECT_EQ(1u, c.allocations());
+    EXPECT_EQ(1u, c.deallocations());
+}
+
+// Pointers with different counting policies don't mix.
+static_assert(!std::is_convertible_v<local_shared_ptr<int>, shared_ptr<int, multi_thread_policy>>);
+static_assert(!std::is_convertible_v<shared_ptr<int, multi_thread_policy>, local_shared_ptr<int>>);
+
+TEST(shared_ptr_testing, local_shared_ptr)
+{
+    test_object::no_new_instances_guard g;
+    local_weak_ptr<test_object> w;
+    {
+        local_shared_ptr<test_object> p = make_shared<test_object, single_thread_policy>(42);
+        local_shared_ptr<test_object> q = p;
+        w = q;
+        EXPECT_EQ(2, p.use_count());
+        EXPECT_EQ(42, *w.lock());
+    }
+    g.expect_no_instances();
+    EXPECT_TRUE(w.expired());
+}
+
+TEST(shared_ptr_testing, biased_release_on_other_thread)
+{
+    bool deleted = false;
+    shared_ptr<derived, biased_policy> p = make_shared<derived, biased_policy>(&deleted);
+    std::thread worker([q = p]() mutable { q.reset(); });
+    worker.join();
+    EXPECT_EQ(1, p.use_count());
+
+    shared_ptr<derived, biased_policy> r = p;
+    std::thread([q = std::move(r)]() mutable { q.reset(); }).join();
+    // The worker queued the block, the owner merges it as it lets go.
+    EXPECT_FALSE(deleted);
+    p.reset();
+    EXPECT_TRUE(deleted);
+}
+
+TEST(shared_ptr_testing, biased_owner_exited)
+{
+    bool deleted = false;
+    shared_ptr<derived, biased_policy> p;
+    std::thread([&] { p = make_shared<derived, biased_policy>(&deleted); }).join();
+    shared_ptr<derived, biased_policy> q = p;
+    EXPECT_EQ(2, q.use_count());
+    p.reset();
+    q.reset();
+    EXPECT_TRUE(deleted);
+}
+
+TEST(shared_ptr_testing, biased_make_shared_throwing_constructor)
+{
+    struct throwing
+    {
+        throwing()
+        {
+            throw std::runtime_error("constructor");
+        }
+    };
+
+    allocation_counter c;
+    std::thread([] { EXPECT_THROW((make_shared<throwing, biased_policy>()), std::runtime_error); }).join();
+    // The thread's owner record goes with the thread, as the failed block
+    // gave its reference back.
+    EXPECT_EQ(c.allocations(), c.deallocations());
+}
+
+TEST(shared_ptr_testing, biased_weak_ptr_lock_on_other_thread)
+{
+    bool deleted = false;
+    shared_ptr<derived, biased_policy> p = make_shared<derived, biased_policy>(&deleted);
+    weak_ptr<derived, biased_policy> w = p;
+    std::thread([&] { EXPECT_TRUE(static_cast<bool>(w.lock())); }).join();
+    p.reset();
+    EXPECT_TRUE(deleted);
+    std::thread([&] { EXPECT_FALSE(static_cast<bool>(w.lock())); }).join();
+}
+
+TEST(shared_ptr_testing, biased_concurrent_copies)
+{
+    bool deleted = false;
+    shared_ptr<derived, biased_policy> p = make_shared<derived, biased_policy>(&deleted);
+    std::vector<std::thread> workers;
+    for (int t = 0; t != 4; ++t)
+    {
+        workers.emplace_back([q = p] {
+            for (int i = 0; i != 10000; ++i)
+            {
+                shared_ptr<derived, biased_policy> copy = q;
+            }
+        });
+    }
+    for (int i = 0; i != 10000; ++i)
+    {
+        shared_ptr<derived, biased_policy> copy = p;
+    }
+    for (std::thread& w : workers)
+    {
+        w.join();
+    }
+    EXPECT_EQ(1, p.use_count());
+    p.reset();
+    biased_policy::drain();
+    EXPECT_TRUE(deleted);
+}
+
+TEST(shared_ptr_testing, allocate_shared)
+{
+    test_object::no_new_instances_guard g;
+    std::size_t allocated = 0;
+    std::size_t deallocated = 0;
+    {
+        shared_ptr<test_object> p = allocate_shared<test_object>(
+            counting_allocator<test_object>(&allocated, &deallocated), 42);
+        EXPECT_EQ(42, *p);
+        EXPECT_EQ(1u, allocated);
+        EXPECT_EQ(0u, deallocated);
+    }
+    EXPECT_EQ(1u, allocated);
+    EXPECT_EQ(1u, deallocated);
+}
+
+TEST(shared_ptr_testing, allocate_shared_weak_ptr)
+{
+    test_object::no_new_instances_guard g;
+    std::size_t allocated = 0;
+    std::size_t deallocated = 0;
+    weak_ptr<test_object> p;
+    {
+        shared_ptr<test_object> q = allocate_shared<test_object>(
+            counting_allocator<char>(&allocated, &deallocated), 42);
+        p = q;
+    }
+    g.expect_no_instances();
+    EXPECT_EQ(0u, deallocated);
+    p.reset();
+    EXPECT_EQ(1u, allocated);
+    EXPECT_EQ(1u, deallocated);
+}
+
+TEST(shared_ptr_testing, allocate_shared_no_global_allocations)
+{
+    allocation_counter c;
+    std::size_t allocated = 0;
+    std::size_t deallocated = 0;
+    bool deleted = false;
+    {
+        shared_ptr<derived> p = allocate_shared<derived>(
+            counting_allocator<derived>(&allocated, &deallocated), &deleted);
+    }
+    EXPECT_TRUE(deleted);
+    EXPECT_EQ(0u, c.allocations());
+    EXPECT_EQ(1u, allocated);
+    EXPECT_EQ(1u, deallocated);
+}
+
+TEST(shared_ptr_testing, ptr_ctor_allocator)
+{
+    test_object::no_new_instances_guard g;
+    std::size_t allocated = 0;
+    std::size_t deallocated = 0;
+    bool deleted = false;
+    {
+        shared_ptr<test_object> p(new test_object(42), custom_deleter<test_object>(&deleted),
+                                  counting_allocator<test_object>(&allocated, &deallocated));
+        EXPECT_EQ(1u, allocated);
+    }
+    EXPECT_TRUE(deleted);
+    EXPECT_EQ(1u, allocated);
+    EXPECT_EQ(1u, deallocated);
+}
+
+TEST(shared_ptr_testing, pool_allocator_reuses_blocks)
+{
+    bool deleted = false;
+    {
+        shared_ptr<derived> p(new derived(&deleted), std::default_delete<derived>(), pool_allocator<derived>());
+    }
+    EXPECT_TRUE(deleted);
+
+    // Only the objects themselves come from operator new now.
+    allocation_counter c;
+    for (int i = 0; i != 100; ++i)
+    {
+        deleted = false;
+        {
+            shared_ptr<derived> p;
+            p.reset(new derived(&deleted), std::default_delete<derived>(), pool_allocator<derived>());
+        }
+        EXPECT_TRUE(deleted);
+    }
+    EXPECT_EQ(100u, c.allocations());
+}
+
+TEST(shared_ptr_testing, pool_allocator_remote_free)
+{
+    test_object::no_new_instances_guard g;
+    shared_ptr<test_object> p;
+    std::thread([&p] {
+        p = shared_ptr<test_object>(new test_object(42), std::default_delete<test_object>(),
+                                    pool_allocator<test_object>());
+    }).join();
+    EXPECT_EQ(42, *p);
+    p.reset();
+    g.expect_no_instances();
+
+    std::thread([&p] {
+        p = shared_ptr<test_object>(new test_object(43), std::default_delete<test_object>(),
+                                    pool_allocator<test_object>());
+    }).join();
+    EXPECT_EQ(43, *p);
+}
+
+TEST(shared_ptr_testing, pool_allocator_over_aligned_object)
+{
+    struct alignas(64) aligned
+    {
+        char data[64];
+    };
+
+    // Only the block comes from the pool, and it isn't over-aligned.
+    shared_ptr<aligned> p(new aligned(), std::default_delete<aligned>(), pool_allocator<aligned>());
+    shared_ptr<aligned> q(new aligned());
+    EXPECT_EQ(1, p.use_count());
+    EXPECT_EQ(1, q.use_count());
+}
+
 TEST(shared_ptr_testing, aliasing_ctor)
 {
     test_object::no_new_instances_guard g;
@@ -566,6 +1151,1411 @@ TEST(shared_ptr_testing, conversions_inheritance)
     EXPECT_EQ(d.get(), b.get());
 }
 
+namespace
+{
+    // Records the order in which instances are destroyed.
+    struct destruction_order
+    {
+        destruction_order()
+            : id(next_id++)
+        {}
+
+        ~destruction_order()
+        {
+            destroyed.push_back(id);
+        }
+
+        int id;
+
+        static int next_id;
+        static std::vector<int> destroyed;
+    };
+
+    int destruction_order::next_id = 0;
+    std::vector<int> destruction_order::destroyed;
+
+    // Copying throws once copies_left reaches zero.
+    struct throwing_copy
+    {
+        explicit throwing_copy(int data)
+            : object(data)
+        {}
+
+        throwing_copy(throwing_copy const& other)
+            : object(other.object)
+        {
+            if (copies_left-- == 0)
+            {
+                throw std::runtime_error("copy failed");
+            }
+        }
+
+        test_object object;
+
+        static int copies_left;
+    };
+
+    int throwing_copy::copies_left = 0;
+}
+
+TEST(shared_ptr_testing, make_shared_array)
+{
+    test_object::no_new_instances_guard g;
+    {
+        shared_ptr<test_object[]> p = make_shared<test_object[]>(5, test_object(42));
+        for (std::ptrdiff_t i = 0; i != 5; ++i)
+        {
+            EXPECT_EQ(42, p[i]);
+        }
+        p[2] = test_object(43);
+        EXPECT_EQ(43, p[2]);
+        EXPECT_EQ(p.get() + 2, &p[2]);
+    }
+    g.expect_no_instances();
+}
+
+TEST(shared_ptr_testing, make_shared_bounded_array)
+{
+    test_object::no_new_instances_guard g;
+    weak_ptr<test_object[3]> q;
+    {
+        shared_ptr<test_object[3]> p = make_shared<test_object[3]>(test_object(42));
+        EXPECT_EQ(42, p[0]);
+        EXPECT_EQ(42, p[2]);
+        q = p;
+        shared_ptr<test_object[]> r = p;
+        EXPECT_EQ(42, r[1]);
+        EXPECT_EQ(2, p.use_count());
+    }
+    g.expect_no_instances();
+    EXPECT_FALSE(static_cast<bool>(q.lock()));
+}
+
+TEST(shared_ptr_testing, make_shared_array_single_allocation)
+{
+    allocation_counter c;
+    {
+        shared_ptr<int[]> p = make_shared<int[]>(100);
+        EXPECT_EQ(1u, c.allocations());
+        for (std::ptrdiff_t i = 0; i != 100; ++i)
+        {
+            EXPECT_EQ(0, p[i]);
+        }
+    }
+    EXPECT_EQ(1u, c.deallocations());
+}
+
+TEST(shared_ptr_testing, make_shared_array_alignment)
+{
+    struct alignas(64) aligned
+    {
+        char data[64];
+    };
+
+    shared_ptr<aligned[]> p = make_shared<aligned[]>(3);
+    for (std::ptrdiff_t i = 0; i != 3; ++i)
+    {
+        EXPECT_EQ(0u, reinterpret_cast<std::uintptr_t>(&p[i]) % alignof(aligned));
+    }
+}
+
+TEST(shared_ptr_testing, make_shared_array_reverse_destruction)
+{
+    destruction_order::next_id = 0;
+    destruction_order::destroyed.clear();
+    make_shared<destruction_order[]>(4);
+    EXPECT_EQ((std::vector<int>{3, 2, 1, 0}), destruction_order::destroyed);
+}
+
+TEST(shared_ptr_testing, make_shared_array_throwing_element)
+{
+    test_object::no_new_instances_guard g;
+    throwing_copy init(42);
+    throwing_copy::copies_left = 3;
+    allocation_counter c;
+    EXPECT_THROW((make_shared<throwing_copy[]>(5, init)), std::runtime_error);
+    EXPECT_EQ(c.allocations(), c.deallocations());
+}
+
+TEST(shared_ptr_testing, allocate_shared_array)
+{
+    test_object::no_new_instances_guard g;
+    std::size_t allocated = 0;
+    std::size_t deallocated = 0;
+    {
+        shared_ptr<test_object[]> p = allocate_shared<test_object[]>(
+            counting_allocator<test_object>(&allocated, &deallocated), 3, test_object(42));
+        EXPECT_EQ(42, p[1]);
+    }
+    EXPECT_EQ(1u, allocated);
+    EXPECT_EQ(1u, deallocated);
+}
+
+TEST(shared_ptr_testing, ptr_ctor_array)
+{
+    test_object::no_new_instances_guard g;
+    shared_ptr<test_object[]> p(new test_object[2]{1, 2});
+    EXPECT_EQ(1, p[0]);
+    EXPECT_EQ(2, p[1]);
+}
+
+TEST(shared_ptr_testing, make_shared_for_overwrite)
+{
+    allocation_counter c;
+    {
+        shared_ptr<int> p = make_shared_for_overwrite<int>();
+        *p = 42;
+        EXPECT_EQ(42, *p);
+        EXPECT_EQ(1u, c.allocations());
+    }
+    EXPECT_EQ(1u, c.deallocations());
+}
+
+TEST(shared_ptr_testing, make_shared_for_overwrite_array)
+{
+    allocation_counter c;
+    {
+        shared_ptr<int[]> p = make_shared_for_overwrite<int[]>(1000);
+        EXPECT_EQ(1u, c.allocations());
+        for (int i = 0; i != 1000; ++i)
+        {
+            p[i] = i;
+        }
+        EXPECT_EQ(999, p[999]);
+
+        shared_ptr<int[16]> q = make_shared_for_overwrite<int[16]>();
+        q[15] = 15;
+        EXPECT_EQ(15, q[15]);
+    }
+    EXPECT_EQ(2u, c.deallocations());
+}
+
+TEST(shared_ptr_testing, make_shared_for_overwrite_runs_default_ctors)
+{
+    destruction_order::next_id = 0;
+    destruction_order::destroyed.clear();
+    {
+        shared_ptr<destruction_order[]> p = make_shared_for_overwrite<destruction_order[]>(3);
+        EXPECT_EQ(2, p[2].id);
+    }
+    EXPECT_EQ((std::vector<int>{2, 1, 0}), destruction_order::destroyed);
+}
+
+// Counts on one cache line, the object on the next.
+using isolated_int_block =
+    detail::inplace_block<int, std::allocator<int>, detail::default_policy, cache_line_isolated_t>;
+static_assert(sizeof(isolated_int_block) == 2 * 64);
+static_assert(alignof(isolated_int_block) == 64);
+
+TEST(shared_ptr_testing, make_shared_cache_line_isolated)
+{
+    test_object::no_new_instances_guard g;
+    weak_ptr<test_object> w;
+    {
+        shared_ptr<test_object> p = make_shared<test_object>(cache_line_isolated, 42);
+        shared_ptr<test_object> q = make_shared<test_object>(cache_line_isolated, 43);
+        EXPECT_EQ(42, *p);
+        EXPECT_EQ(43, *q);
+        EXPECT_EQ(0u, reinterpret_cast<std::uintptr_t>(p.get()) % 64);
+        EXPECT_EQ(0u, reinterpret_cast<std::uintptr_t>(q.get()) % 64);
+        w = p;
+    }
+    g.expect_no_instances();
+    EXPECT_TRUE(w.expired());
+}
+
+TEST(shared_ptr_testing, allocate_shared_cache_line_isolated)
+{
+    test_object::no_new_instances_guard g;
+    std::size_t allocated = 0;
+    std::size_t deallocated = 0;
+    {
+        shared_ptr<test_object> p = allocate_shared<test_object>(
+            counting_allocator<test_object>(&allocated, &deallocated), cache_line_isolated, 42);
+        EXPECT_EQ(42, *p);
+        EXPECT_EQ(0u, reinterpret_cast<std::uintptr_t>(p.get()) % 64);
+    }
+    EXPECT_EQ(1u, allocated);
+    EXPECT_EQ(1u, deallocated);
+}
+
+static_assert(sizeof(thin_shared_ptr<test_object>) == sizeof(void*));
+
+TEST(shared_ptr_testing, thin_from_make_shared)
+{
+    test_object::no_new_instances_guard g;
+    shared_ptr<test_object> p = make_shared<test_object>(42);
+    thin_shared_ptr<test_object> q = p;
+    EXPECT_EQ(2, p.use_count());
+    EXPECT_EQ(p.get(), q.get());
+    EXPECT_EQ(42, *q);
+    EXPECT_EQ(42, q->operator int());
+}
+
+TEST(shared_ptr_testing, thin_move_keeps_count)
+{
+    test_object::no_new_instances_guard g;
+    shared_ptr<test_object> p(new test_object(42));
+    test_object* object = p.get();
+    thin_shared_ptr<test_object> q = std::move(p);
+    EXPECT_FALSE(static_cast<bool>(p));
+    EXPECT_EQ(object, q.get());
+    EXPECT_EQ(1, q.use_count());
+
+    shared_ptr<test_object> r = std::move(q);
+    EXPECT_FALSE(static_cast<bool>(q));
+    EXPECT_EQ(object, r.get());
+    EXPECT_EQ(1, r.use_count());
+}
+
+TEST(shared_ptr_testing, thin_copy)
+{
+    test_object::no_new_instances_guard g;
+    thin_shared_ptr<test_object> p = make_shared<test_object>(42);
+    thin_shared_ptr<test_object> q = p;
+    EXPECT_TRUE(p == q);
+    EXPECT_EQ(2, p.use_count());
+    p.reset();
+    EXPECT_TRUE(p == nullptr);
+    EXPECT_EQ(42, *q);
+}
+
+TEST(shared_ptr_testing, thin_aliasing)
+{
+    test_object::no_new_instances_guard g;
+    int x = 0;
+    thin_shared_ptr<int> q;
+    {
+        shared_ptr<test_object> p(new test_object(42));
+        q = shared_ptr<int>(p, &x);
+        EXPECT_EQ(&x, q.get());
+        EXPECT_EQ(2, p.use_count());
+    }
+    shared_ptr<int> r = q;
+    EXPECT_EQ(&x, r.get());
+    q.reset();
+    EXPECT_EQ(1, r.use_count());
+    r.reset();
+    g.expect_no_instances();
+}
+
+TEST(shared_ptr_testing, thin_conversion_with_offset)
+{
+    struct first
+    {
+        int a = 1;
+    };
+    struct second
+    {
+        int b = 2;
+    };
+    struct both : first, second
+    {};
+
+    thin_shared_ptr<both> p = make_shared<both>();
+    thin_shared_ptr<second> q = p;
+    EXPECT_EQ(static_cast<second*>(p.get()), q.get());
+    EXPECT_EQ(2, q->b);
+
+    weak_ptr<second> w = q;
+    p.reset();
+    q.reset();
+    EXPECT_TRUE(w.expired());
+}
+
+TEST(shared_ptr_testing, thin_weak_ptr)
+{
+    test_object::no_new_instances_guard g;
+    weak_ptr<test_object> w;
+    {
+        thin_shared_ptr<test_object> p = make_shared<test_object>(42);
+        w = p;
+        EXPECT_EQ(42, *w.lock());
+    }
+    g.expect_no_instances();
+    EXPECT_FALSE(static_cast<bool>(w.lock()));
+}
+
+namespace
+{
+    using shared_test_object = shared_ptr<test_object, multi_thread_policy>;
+}
+
+TEST(shared_ptr_testing, atomic_shared_ptr_load_store)
+{
+    test_object::no_new_instances_guard g;
+    shared_test_object p = make_shared<test_object, multi_thread_policy>(42);
+    {
+        atomic_shared_ptr<test_object> a;
+        EXPECT_FALSE(static_cast<bool>(a.load()));
+        a.store(p);
+        shared_test_object q = a.load();
+        EXPECT_EQ(p, q);
+        EXPECT_EQ(42, *q);
+        a = nullptr;
+        EXPECT_FALSE(static_cast<bool>(a.load()));
+        EXPECT_EQ(2, p.use_count());
+        a = p;
+    }
+    EXPECT_EQ(1, p.use_count());
+    p.reset();
+    g.expect_no_instances();
+}
+
+TEST(shared_ptr_testing, atomic_shared_ptr_exchange)
+{
+    test_object::no_new_instances_guard g;
+    atomic_shared_ptr<test_object> a(make_shared<test_object, multi_thread_policy>(1));
+    shared_test_object old = a.exchange(make_shared<test_object, multi_thread_policy>(2));
+    EXPECT_EQ(1, *old);
+    EXPECT_EQ(1, old.use_count());
+    EXPECT_EQ(2, *a.load());
+    old = a.exchange(nullptr);
+    EXPECT_EQ(2, *old);
+    EXPECT_EQ(1, old.use_count());
+    old.reset();
+    g.expect_no_instances();
+}
+
+TEST(shared_ptr_testing, atomic_shared_ptr_compare_exchange)
+{
+    test_object::no_new_instances_guard g;
+    shared_test_object p = make_shared<test_object, multi_thread_policy>(1);
+    shared_test_object q = make_shared<test_object, multi_thread_policy>(2);
+    {
+        atomic_shared_ptr<test_object> a(p);
+        shared_test_object expected = q;
+        EXPECT_FALSE(a.compare_exchange_strong(expected, q));
+        EXPECT_EQ(p, expected);
+        EXPECT_TRUE(a.compare_exchange_weak(expected, q));
+        EXPECT_EQ(q, a.load());
+        EXPECT_EQ(2, p.use_count());
+
+        // Same pointer with another owner is not equivalent.
+        expected = shared_test_object(p, q.get());
+        EXPECT_FALSE(a.compare_exchange_strong(expected, nullptr));
+        EXPECT_EQ(q, expected);
+        EXPECT_TRUE(a.compare_exchange_strong(expected, nullptr));
+        EXPECT_FALSE(static_cast<bool>(a.load()));
+    }
+    EXPECT_EQ(1, p.use_count());
+    EXPECT_EQ(1, q.use_count());
+    p.reset();
+    q.reset();
+    g.expect_no_instances();
+}
+
+TEST(shared_ptr_testing, atomic_shared_ptr_aliasing)
+{
+    test_object::no_new_instances_guard g;
+    int x = 0;
+    shared_test_object p = make_shared<test_object, multi_thread_policy>(42);
+    {
+        atomic_shared_ptr<int> a(shared_ptr<int, multi_thread_policy>(p, &x));
+        shared_ptr<int, multi_thread_policy> q = a.load();
+        EXPECT_EQ(&x, q.get());
+        shared_ptr<int, multi_thread_policy> expected = q;
+        EXPECT_TRUE(a.compare_exchange_strong(expected, nullptr));
+        EXPECT_EQ(3, p.use_count());
+    }
+    EXPECT_EQ(1, p.use_count());
+    p.reset();
+    g.expect_no_instances();
+}
+
+TEST(shared_ptr_testing, atomic_shared_ptr_loads_past_batch)
+{
+    test_object::no_new_instances_guard g;
+    shared_test_object p = make_shared<test_object, multi_thread_policy>(42);
+    std::vector<shared_test_object> kept;
+    {
+        atomic_shared_ptr<test_object> a(p);
+        for (int i = 0; i != 100000; ++i)
+        {
+            shared_test_object q = a.load();
+            if (i % 2 == 0)
+            {
+                kept.push_back(std::move(q));
+            }
+        }
+        EXPECT_EQ(p, a.load());
+    }
+    EXPECT_EQ(50001, p.use_count());
+    kept.clear();
+    EXPECT_EQ(1, p.use_count());
+    p.reset();
+    g.expect_no_instances();
+}
+
+TEST(shared_ptr_testing, atomic_shared_ptr_many_cells_one_block)
+{
+    test_object::no_new_instances_guard g;
+    // With full batches of 1 << 14 plus the reference each store takes over,
+    // the cells and copies below add up to 2^32 + 1: a 32-bit count would
+    // read as just the reference p holds.
+    std::size_t const n = 262128;
+    std::unique_ptr<atomic_shared_ptr<test_object>[]> cells(new atomic_shared_ptr<test_object>[n]);
+    shared_test_object p = make_shared<test_object, multi_thread_policy>(42);
+    std::vector<shared_test_object> copies(16, p);
+    for (std::size_t i = 0; i != n; ++i)
+    {
+        cells[i].store(p);
+    }
+    p.reset();
+    copies.clear();
+    EXPECT_EQ(42, *cells[0].load());
+    EXPECT_EQ(42, *cells[n - 1].load());
+    for (std::size_t i = 0; i != n; ++i)
+    {
+        cells[i] = nullptr;
+    }
+    g.expect_no_instances();
+}
+
+TEST(shared_ptr_testing, atomic_shared_ptr_concurrent)
+{
+    test_object::no_new_instances_guard g;
+    {
+        atomic_shared_ptr<test_object> a(make_shared<test_object, multi_thread_policy>(0));
+        std::atomic<bool> done{false};
+        std::vector<std::thread> readers;
+        for (int t = 0; t != 4; ++t)
+        {
+            readers.emplace_back([&] {
+                int last = 0;
+                while (!done.load(std::memory_order_relaxed))
+                {
+                    shared_test_object q = a.load();
+                    EXPECT_LE(last, *q);
+                    last = *q;
+                }
+            });
+        }
+        for (int i = 1; i != 2000; ++i)
+        {
+            if (i % 2 == 0)
+            {
+                a.store(make_shared<test_object, multi_thread_policy>(i));
+            }
+            else
+            {
+                shared_test_object expected = a.load();
+                EXPECT_TRUE(a.compare_exchange_strong(expected, make_shared<test_object, multi_thread_policy>(i)));
+            }
+        }
+        done = true;
+        for (std::thread& reader : readers)
+        {
+            reader.join();
+        }
+        EXPECT_EQ(1999, *a.load());
+    }
+    g.expect_no_instances();
+}
+
+TEST(shared_ptr_testing, atomic_weak_ptr_load_store)
+{
+    test_object::no_new_instances_guard g;
+    shared_test_object p = make_shared<test_object, multi_thread_policy>(42);
+    {
+        atomic_weak_ptr<test_object> a;
+        EXPECT_FALSE(static_cast<bool>(a.load().lock()));
+        a = p;
+        EXPECT_EQ(p, a.load().lock());
+        EXPECT_EQ(1, p.use_count());
+
+        shared_test_object q = make_shared<test_object, multi_thread_policy>(43);
+        weak_ptr<test_object, multi_thread_policy> old = a.exchange(q);
+        EXPECT_EQ(p, old.lock());
+        q.reset();
+        EXPECT_TRUE(a.load().expired());
+        a.store(p);
+        p.reset();
+        EXPECT_TRUE(a.load().expired());
+    }
+    g.expect_no_instances();
+}
+
+TEST(shared_ptr_testing, atomic_weak_ptr_compare_exchange)
+{
+    shared_test_object p = make_shared<test_object, multi_thread_policy>(1);
+    shared_test_object q = make_shared<test_object, multi_thread_policy>(2);
+    atomic_weak_ptr<test_object> a(p);
+    weak_ptr<test_object, multi_thread_policy> expected = q;
+    EXPECT_FALSE(a.compare_exchange_strong(expected, q));
+    EXPECT_EQ(p, expected.lock());
+    EXPECT_TRUE(a.compare_exchange_weak(expected, q));
+    EXPECT_EQ(q, a.load().lock());
+}
+
+TEST(shared_ptr_testing, atomic_weak_ptr_conversion_with_offset)
+{
+    struct first
+    {
+        int a = 1;
+    };
+    struct second
+    {
+        int b = 2;
+    };
+    struct both : first, second
+    {};
+
+    allocation_counter c;
+    {
+        shared_ptr<both, multi_thread_policy> p = make_shared<both, multi_thread_policy>();
+        weak_ptr<second, multi_thread_policy> w = p;
+        atomic_weak_ptr<second> a(std::move(w));
+        shared_ptr<second, multi_thread_policy> q = a.load().lock();
+        EXPECT_EQ(static_cast<second*>(p.get()), q.get());
+        EXPECT_EQ(2, q->b);
+        EXPECT_EQ(2, p.use_count());
+        q.reset();
+        p.reset();
+        EXPECT_FALSE(static_cast<bool>(a.load().lock()));
+    }
+    EXPECT_EQ(c.allocations(), c.deallocations());
+}
+
+TEST(shared_ptr_testing, atomic_weak_ptr_store_races_lock)
+{
+    test_object::no_new_instances_guard g;
+    {
+        atomic_weak_ptr<test_object> a;
+        std::atomic<bool> done{false};
+        std::vector<std::thread> readers;
+        for (int t = 0; t != 4; ++t)
+        {
+            readers.emplace_back([&] {
+                while (!done.load(std::memory_order_relaxed))
+                {
+                    if (shared_test_object q = a.load().lock())
+                    {
+                        EXPECT_LE(0, *q);
+                    }
+                }
+            });
+        }
+        // Every object expires right after it is published, while readers
+        // may be locking it.
+        for (int i = 0; i != 2000; ++i)
+        {
+            shared_test_object p = make_shared<test_object, multi_thread_policy>(i);
+            a.store(p);
+            std::this_thread::yield();
+        }
+        done = true;
+        for (std::thread& reader : readers)
+        {
+            reader.join();
+        }
+        EXPECT_TRUE(a.load().expired());
+    }
+    g.expect_no_instances();
+}
+
+TEST(shared_ptr_testing, hazard_pointer_keeps_replaced_value)
+{
+    test_object::no_new_instances_guard g;
+    {
+        atomic_shared_ptr<test_object, hazard_reclaim> a(make_shared<test_object, multi_thread_policy>(1));
+        hazard_pointer h;
+        test_object* p = h.protect(a);
+        EXPECT_EQ(1, *p);
+
+        a.store(make_shared<test_object, multi_thread_policy>(2));
+        hazard_domain::global().reclaim();
+        EXPECT_EQ(1, *p);
+
+        h.reset();
+        EXPECT_EQ(2, *h.protect(a));
+    }
+    hazard_domain::global().reclaim();
+    g.expect_no_instances();
+}
+
+TEST(shared_ptr_testing, hazard_pointer_empty_cell)
+{
+    atomic_shared_ptr<int, hazard_reclaim> a;
+    hazard_pointer h;
+    EXPECT_EQ(nullptr, h.protect(a));
+}
+
+TEST(shared_ptr_testing, hazard_pointer_concurrent)
+{
+    test_object::no_new_instances_guard g;
+    {
+        atomic_shared_ptr<test_object, hazard_reclaim> a(make_shared<test_object, multi_thread_policy>(0));
+        std::atomic<bool> done{false};
+        std::vector<std::thread> readers;
+        for (int t = 0; t != 4; ++t)
+        {
+            readers.emplace_back([&] {
+                hazard_pointer h;
+                int last = 0;
+                while (!done.load(std::memory_order_relaxed))
+                {
+                    int const value = *h.protect(a);
+                    EXPECT_LE(last, value);
+                    last = value;
+                }
+            });
+        }
+        for (int i = 1; i != 2000; ++i)
+        {
+            a.store(make_shared<test_object, multi_thread_policy>(i));
+        }
+        done = true;
+        for (std::thread& reader : readers)
+        {
+            reader.join();
+        }
+    }
+    hazard_domain::global().reclaim();
+    g.expect_no_instances();
+}
+
+TEST(shared_ptr_testing, rcu_cell_read_store)
+{
+    test_object::no_new_instances_guard g;
+    {
+        rcu_cell<test_object> cell(make_shared<test_object const, multi_thread_policy>(1));
+        {
+            rcu_read_guard guard;
+            EXPECT_EQ(1, *cell.read(guard));
+        }
+        weak_ptr<test_object const, multi_thread_policy> old = cell.load();
+        cell.store(make_shared<test_object const, multi_thread_policy>(2));
+        // No read section was open, so the old value goes right away.
+        EXPECT_TRUE(old.expired());
+        EXPECT_EQ(2, *cell.load());
+
+        rcu_read_guard outer;
+        {
+            rcu_read_guard inner;
+            EXPECT_EQ(2, *cell.read(inner));
+        }
+        EXPECT_EQ(2, *cell.read(outer));
+    }
+    g.expect_no_instances();
+}
+
+TEST(shared_ptr_testing, rcu_cell_grace_period)
+{
+    test_object::no_new_instances_guard g;
+    {
+        rcu_cell<test_object> cell(make_shared<test_object const, multi_thread_policy>(1));
+        weak_ptr<test_object const, multi_thread_policy> old = cell.load();
+        std::atomic<int> step{0};
+        std::thread reader([&] {
+            rcu_read_guard guard;
+            test_object const* p = cell.read(guard);
+            step = 1;
+            while (step != 2)
+            {
+                std::this_thread::yield();
+            }
+            EXPECT_EQ(1, *p);
+        });
+        while (step != 1)
+        {
+            std::this_thread::yield();
+        }
+
+        cell.store(make_shared<test_object const, multi_thread_policy>(2));
+        EXPECT_FALSE(old.expired());
+        std::atomic<bool> synchronized{false};
+        std::thread writer([&] {
+            cell.synchronize();
+            synchronized = true;
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        EXPECT_FALSE(synchronized);
+        EXPECT_FALSE(old.expired());
+
+        step = 2;
+        reader.join();
+        writer.join();
+        EXPECT_TRUE(old.expired());
+    }
+    g.expect_no_instances();
+}
+
+TEST(shared_ptr_testing, rcu_cell_store_out_of_memory)
+{
+    test_object::no_new_instances_guard g;
+    {
+        rcu_cell<test_object> cell(make_shared<test_object const, multi_thread_policy>(1));
+        rcu_cell<test_object>::value_type next = make_shared<test_object const, multi_thread_policy>(2);
+        {
+            failing_allocations f;
+            EXPECT_THROW(cell.store(next), std::bad_alloc);
+        }
+        EXPECT_EQ(1, *cell.load());
+        EXPECT_EQ(1, next.use_count());
+        cell.store(next);
+        EXPECT_EQ(2, *cell.load());
+    }
+    g.expect_no_instances();
+}
+
+TEST(shared_ptr_testing, rcu_cell_concurrent)
+{
+    test_object::no_new_instances_guard g;
+    {
+        rcu_cell<test_object> cell(make_shared<test_object const, multi_thread_policy>(0));
+        std::atomic<bool> done{false};
+        std::vector<std::thread> readers;
+        for (int t = 0; t != 4; ++t)
+        {
+            readers.emplace_back([&] {
+                int last = 0;
+                while (!done.load(std::memory_order_relaxed))
+                {
+                    rcu_read_guard guard;
+                    int const value = *cell.read(guard);
+                    EXPECT_LE(last, value);
+                    last = value;
+                }
+            });
+        }
+        for (int i = 1; i != 2000; ++i)
+        {
+            cell.store(make_shared<test_object const, multi_thread_policy>(i));
+        }
+        done = true;
+        for (std::thread& reader : readers)
+        {
+            reader.join();
+        }
+        cell.synchronize();
+    }
+    g.expect_no_instances();
+}
+
+TEST(shared_ptr_testing, deferred_policy_destroys_off_thread)
+{
+    struct recorder
+    {
+        explicit recorder(std::thread::id* destroyed_on)
+            : destroyed_on(destroyed_on)
+        {}
+
+        ~recorder()
+        {
+            *destroyed_on = std::this_thread::get_id();
+        }
+
+        std::thread::id* destroyed_on;
+    };
+
+    std::thread::id destroyed_on;
+    shared_ptr<recorder, deferred_policy> p = make_shared<recorder, deferred_policy>(&destroyed_on);
+    weak_ptr<recorder, deferred_policy> w = p;
+    p.reset();
+    EXPECT_TRUE(w.expired());
+    EXPECT_FALSE(w.lock());
+    deferred_policy::drain();
+    EXPECT_NE(std::thread::id(), destroyed_on);
+    EXPECT_NE(std::this_thread::get_id(), destroyed_on);
+}
+
+TEST(shared_ptr_testing, deferred_policy_keeps_release_order)
+{
+    struct recorder
+    {
+        recorder(int id, std::vector<int>* order)
+            : id(id)
+            , order(order)
+        {}
+
+        ~recorder()
+        {
+            order->push_back(id);
+        }
+
+        int id;
+        std::vector<int>* order;
+    };
+
+    std::vector<int> order;
+    std::vector<shared_ptr<recorder, deferred_policy>> ptrs;
+    for (int i = 0; i != 1000; ++i)
+    {
+        ptrs.push_back(make_shared<recorder, deferred_policy>(i, &order));
+    }
+    for (shared_ptr<recorder, deferred_policy>& p : ptrs)
+    {
+        p.reset();
+    }
+    deferred_policy::drain();
+    ASSERT_EQ(1000u, order.size());
+    for (int i = 0; i != 1000; ++i)
+    {
+        EXPECT_EQ(i, order[i]);
+    }
+}
+
+TEST(shared_ptr_testing, deferred_policy_drain_waits_for_cascades)
+{
+    struct node
+    {
+        test_object value;
+        shared_ptr<node, deferred_policy> next;
+    };
+
+    test_object::no_new_instances_guard g;
+    {
+        shared_ptr<node, deferred_policy> head;
+        for (int i = 0; i != 100; ++i)
+        {
+            head = make_shared<node, deferred_policy>(node{test_object(i), std::move(head)});
+        }
+    }
+    deferred_policy::drain();
+    g.expect_no_instances();
+}
+
+TEST(shared_ptr_testing, deferred_policy_concurrent)
+{
+    test_object::no_new_instances_guard g;
+    std::vector<std::thread> threads;
+    for (int t = 0; t != 4; ++t)
+    {
+        threads.emplace_back([] {
+            shared_ptr<test_object, deferred_policy> shared = make_shared<test_object, deferred_policy>(0);
+            for (int i = 0; i != 10000; ++i)
+            {
+                shared_ptr<test_object, deferred_policy> p = make_shared<test_object, deferred_policy>(i);
+                shared_ptr<test_object, deferred_policy> copy = shared;
+            }
+        });
+    }
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+    deferred_policy::drain();
+    g.expect_no_instances();
+}
+
+TEST(shared_ptr_testing, sharded_policy_lives_until_collapsed)
+{
+    test_object::no_new_instances_guard g;
+    {
+        hot_shared_ptr<test_object> p = make_shared<test_object, sharded_policy>(42);
+        weak_ptr<test_object, sharded_policy> w = p;
+        hot_shared_ptr<test_object> q = p;
+        EXPECT_EQ(2, p.use_count());
+        q.reset();
+        EXPECT_EQ(1, p.use_count());
+
+        sharded_policy::collapse(p);
+        sharded_policy::collapse(p);
+        EXPECT_EQ(1, p.use_count());
+        q = w.lock();
+        EXPECT_EQ(2, p.use_count());
+        p.reset();
+        q.reset();
+        EXPECT_TRUE(w.expired());
+        EXPECT_FALSE(w.lock());
+    }
+    g.expect_no_instances();
+}
+
+TEST(shared_ptr_testing, sharded_policy_aliasing)
+{
+    struct pair
+    {
+        test_object first;
+        test_object second;
+    };
+
+    test_object::no_new_instances_guard g;
+    {
+        hot_shared_ptr<pair> p = make_shared<pair, sharded_policy>(pair{test_object(1), test_object(2)});
+        hot_shared_ptr<test_object> second(p, &p->second);
+        sharded_policy::collapse(second);
+        p.reset();
+        EXPECT_EQ(2, *second);
+    }
+    g.expect_no_instances();
+}
+
+TEST(shared_ptr_testing, sharded_policy_concurrent_collapse)
+{
+    test_object::no_new_instances_guard g;
+    {
+        hot_shared_ptr<test_object> p = make_shared<test_object, sharded_policy>(0);
+        weak_ptr<test_object, sharded_policy> w = p;
+        std::vector<std::thread> threads;
+        for (int t = 0; t != 8; ++t)
+        {
+            threads.emplace_back([&, copy = p]() mutable {
+                std::vector<hot_shared_ptr<test_object>> held;
+                for (int i = 0; i != 20000; ++i)
+                {
+                    held.push_back(copy);
+                    if (hot_shared_ptr<test_object> locked = w.lock())
+                    {
+                        held.push_back(std::move(locked));
+                    }
+                    if (held.size() > 8)
+                    {
+                        held.erase(held.begin(), held.begin() + 5);
+                    }
+                }
+            });
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        sharded_policy::collapse(p);
+        for (std::thread& thread : threads)
+        {
+            thread.join();
+        }
+        EXPECT_EQ(1, p.use_count());
+        p.reset();
+        EXPECT_TRUE(w.expired());
+    }
+    g.expect_no_instances();
+}
+
+TEST(shared_ptr_testing, release_batch_defers_releases)
+{
+    test_object::no_new_instances_guard g;
+    {
+        shared_ptr<test_object, batched_policy> p = make_shared<test_object, batched_policy>(5);
+        weak_ptr<test_object, batched_policy> w = p;
+        {
+            release_batch batch;
+            std::vector<shared_ptr<test_object, batched_policy>> copies(100, p);
+            EXPECT_EQ(101, p.use_count());
+            copies.clear();
+            p.reset();
+            EXPECT_EQ(101, w.use_count());
+            EXPECT_FALSE(w.expired());
+        }
+        EXPECT_TRUE(w.expired());
+    }
+    g.expect_no_instances();
+}
+
+TEST(shared_ptr_testing, release_batch_many_blocks)
+{
+    test_object::no_new_instances_guard g;
+    {
+        std::vector<shared_ptr<test_object, batched_policy>> ptrs;
+        for (int i = 0; i != 1000; ++i)
+        {
+            ptrs.push_back(make_shared<test_object, batched_policy>(i));
+            ptrs.push_back(ptrs.back());
+        }
+        release_batch batch;
+        ptrs.clear();
+    }
+    g.expect_no_instances();
+}
+
+TEST(shared_ptr_testing, release_batch_cascades_and_nests)
+{
+    struct node
+    {
+        test_object value;
+        shared_ptr<node, batched_policy> next;
+    };
+
+    test_object::no_new_instances_guard g;
+    {
+        release_batch outer;
+        shared_ptr<node, batched_policy> head;
+        for (int i = 0; i != 200; ++i)
+        {
+            head = make_shared<node, batched_policy>(node{test_object(i), std::move(head)});
+        }
+        {
+            release_batch inner;
+            EXPECT_EQ(&inner, release_batch::current());
+            head.reset();
+        }
+        EXPECT_EQ(&outer, release_batch::current());
+    }
+    EXPECT_EQ(nullptr, release_batch::current());
+    g.expect_no_instances();
+}
+
+namespace
+{
+    int read_borrowed(borrowed_ptr<test_object> p, int depth)
+    {
+        return depth == 0 ? int(*p) : read_borrowed(p, depth - 1);
+    }
+}
+
+TEST(shared_ptr_testing, borrowed_ptr_leaves_count_alone)
+{
+    test_object::no_new_instances_guard g;
+    {
+        shared_ptr<test_object> p = make_shared<test_object>(7);
+        borrowed_ptr<test_object> b = p;
+        EXPECT_EQ(1, p.use_count());
+        EXPECT_EQ(p.get(), b.get());
+        EXPECT_EQ(7, read_borrowed(b, 10));
+        EXPECT_EQ(1, p.use_count());
+
+        shared_ptr<test_object> kept = b.share();
+        EXPECT_EQ(2, p.use_count());
+        EXPECT_EQ(p, kept);
+    }
+    g.expect_no_instances();
+}
+
+TEST(shared_ptr_testing, borrowed_ptr_empty_and_converting)
+{
+    borrowed_ptr<test_object> empty;
+    EXPECT_FALSE(empty);
+    EXPECT_FALSE(empty.share());
+    borrowed_ptr<test_object> null = nullptr;
+    EXPECT_FALSE(null);
+
+    bool deleted = false;
+    {
+        shared_ptr<derived> p = make_shared<derived>(&deleted);
+        borrowed_ptr<derived> b = p;
+        borrowed_ptr<base> converted = b;
+        EXPECT_EQ(static_cast<base*>(p.get()), converted.get());
+        shared_ptr<base> shared = converted.share();
+        EXPECT_EQ(2, p.use_count());
+    }
+    EXPECT_TRUE(deleted);
+}
+
+#ifdef SHARED_PTR_CHECK_BORROWS
+TEST(shared_ptr_testing, borrowed_ptr_outliving_object_aborts)
+{
+    EXPECT_DEATH(
+        {
+            shared_ptr<int> p = make_shared<int>(1);
+            borrowed_ptr<int> b = p;
+            p.reset();
+            (void)*b;
+        },
+        "borrowed_ptr");
+}
+#else
+static_assert(std::is_trivially_copyable_v<borrowed_ptr<int>>);
+#endif
+
+namespace
+{
+    struct quote
+    {
+        std::int64_t bid;
+        std::int64_t ask;
+        std::int32_t version;
+    };
+}
+
+TEST(shared_ptr_testing, seqlock_shared_cell_read_store)
+{
+    seqlock_shared_cell<quote> cell(make_shared<quote const, multi_thread_policy>(quote{100, 101, 1}));
+    EXPECT_EQ(100, cell.read([](quote const& q) { return q.bid; }));
+
+    shared_ptr<quote const, multi_thread_policy> next = make_shared<quote const, multi_thread_policy>(quote{102, 104, 2});
+    cell.store(next);
+    EXPECT_EQ(2, cell.read([](quote const& q) { return q.version; }));
+    EXPECT_EQ(104, cell.read([](quote const& q) { return q.ask; }));
+    EXPECT_EQ(next, cell.load());
+}
+
+TEST(shared_ptr_testing, seqlock_shared_cell_concurrent)
+{
+    seqlock_shared_cell<quote> cell(make_shared<quote const, multi_thread_policy>(quote{0, 1, 0}));
+    std::atomic<bool> done{false};
+    std::vector<std::thread> readers;
+    for (int t = 0; t != 4; ++t)
+    {
+        readers.emplace_back([&] {
+            std::int32_t last = 0;
+            while (!done.load(std::memory_order_relaxed))
+            {
+                quote const q = cell.read([](quote const& q) { return q; });
+                EXPECT_EQ(q.bid + 1, q.ask);
+                EXPECT_EQ(q.bid, 3 * q.version);
+                EXPECT_LE(last, q.version);
+                last = q.version;
+                EXPECT_LE(last, cell.load()->version + 1);
+            }
+        });
+    }
+    for (std::int32_t i = 1; i != 20000; ++i)
+    {
+        cell.store(make_shared<quote const, multi_thread_policy>(quote{3 * i, 3 * i + 1, i}));
+    }
+    done = true;
+    for (std::thread& reader : readers)
+    {
+        reader.join();
+    }
+}
+
+TEST(shared_ptr_testing, ebr_guard_keeps_replaced_value)
+{
+    test_object::no_new_instances_guard g;
+    {
+        atomic_shared_ptr<test_object, ebr_reclaim> a(make_shared<test_object, multi_thread_policy>(1));
+        weak_ptr<test_object, multi_thread_policy> old = a.load();
+        {
+            ebr_guard guard;
+            test_object* p = guard.protect(a);
+            EXPECT_EQ(1, *p);
+            a.store(make_shared<test_object, multi_thread_policy>(2));
+            ebr_domain::global().reclaim();
+            EXPECT_FALSE(old.expired());
+            EXPECT_EQ(1, *p);
+            EXPECT_EQ(2, *guard.protect(a));
+        }
+        ebr_domain::global().reclaim();
+        EXPECT_TRUE(old.expired());
+    }
+    ebr_domain::global().reclaim();
+    g.expect_no_instances();
+}
+
+TEST(shared_ptr_testing, ebr_retire_out_of_memory)
+{
+    test_object::no_new_instances_guard g;
+    {
+        atomic_shared_ptr<test_object, ebr_reclaim> a(make_shared<test_object, multi_thread_policy>(1));
+        weak_ptr<test_object, multi_thread_policy> old = a.load();
+        shared_test_object next = make_shared<test_object, multi_thread_policy>(2);
+        // A new thread's queue has no room yet, so the replaced value waits
+        // out its grace period in store().
+        std::thread writer([&] {
+            failing_allocations f;
+            a.store(std::move(next));
+        });
+        writer.join();
+        EXPECT_TRUE(old.expired());
+        EXPECT_EQ(2, *a.load());
+    }
+    ebr_domain::global().reclaim();
+    g.expect_no_instances();
+}
+
+TEST(shared_ptr_testing, ebr_low_rate_writer)
+{
+    test_object::no_new_instances_guard g;
+    {
+        atomic_shared_ptr<test_object, ebr_reclaim> a(make_shared<test_object, multi_thread_policy>(0));
+        std::thread writer([&] {
+            for (int i = 1; i != 4; ++i)
+            {
+                weak_ptr<test_object, multi_thread_policy> old = a.load();
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+                a.store(make_shared<test_object, multi_thread_policy>(i));
+                // Far fewer retires than a scan takes, but no reader holds
+                // the old value and the last scan was a while ago.
+                EXPECT_TRUE(old.expired());
+            }
+        });
+        writer.join();
+    }
+    ebr_domain::global().reclaim();
+    g.expect_no_instances();
+}
+
+TEST(shared_ptr_testing, ebr_guard_empty_cell)
+{
+    atomic_shared_ptr<int, ebr_reclaim> a;
+    ebr_guard guard;
+    EXPECT_EQ(nullptr, guard.protect(a));
+}
+
+TEST(shared_ptr_testing, ebr_concurrent)
+{
+    test_object::no_new_instances_guard g;
+    {
+        atomic_shared_ptr<test_object, ebr_reclaim> a(make_shared<test_object, multi_thread_policy>(0));
+        std::atomic<bool> done{false};
+        std::vector<std::thread> readers;
+        for (int t = 0; t != 4; ++t)
+        {
+            readers.emplace_back([&] {
+                int last = 0;
+                while (!done.load(std::memory_order_relaxed))
+                {
+                    ebr_guard guard;
+                    for (int i = 0; i != 8; ++i)
+                    {
+                        test_object const* p = guard.protect(a);
+                        int const value = *p;
+                        EXPECT_LE(last, value);
+                        last = value;
+                        std::this_thread::yield();
+                        EXPECT_EQ(value, *p);
+                    }
+                }
+            });
+        }
+        for (int i = 1; i != 5000; ++i)
+        {
+            a.store(make_shared<test_object, multi_thread_policy>(i));
+        }
+        done = true;
+        for (std::thread& reader : readers)
+        {
+            reader.join();
+        }
+    }
+    ebr_domain::global().reclaim();
+    g.expect_no_instances();
+}
+
+namespace
+{
+    // Threads copy, move, reset, lock and assign their own handles to a
+    // few shared objects while the main thread drops its references, so
+    // last releases race with copies and locks. Sharing the objects is
+    // what the counts have to survive: assigning one shared_ptr instance
+    // from several threads at once is a data race, as with std::shared_ptr.
+    template <typename Policy>
+    void stress_ownership(unsigned threads, int iterations)
+    {
+        using strong = shared_ptr<test_object, Policy>;
+        using weak = weak_ptr<test_object, Policy>;
+
+        std::vector<strong> owners;
+        std::vector<weak> watchers;
+        for (int i = 0; i != 4; ++i)
+        {
+            owners.push_back(make_shared<test_object, Policy>(i));
+            watchers.push_back(owners.back());
+        }
+
+        std::atomic<unsigned> started{0};
+        std::vector<std::thread> workers;
+        for (unsigned t = 0; t != threads; ++t)
+        {
+            workers.emplace_back([&, t, copies = owners] {
+                std::uint32_t random = t * 2654435761u + 1;
+                auto next = [&random](std::uint32_t bound) {
+                    random = random * 1664525u + 1013904223u;
+                    return (random >> 8) % bound;
+                };
+                strong slots[4];
+                weak weak_slots[2];
+                ++started;
+                for (int i = 0; i != iterations; ++i)
+                {
+                    strong& slot = slots[next(4)];
+                    switch (next(7))
+                    {
+                    case 0:
+                        slot = copies[next(4)];
+                        break;
+                    case 1:
+                        slot = std::move(slots[next(4)]);
+                        break;
+                    case 2:
+                        slot.reset();
+                        break;
+                    case 3:
+                        slot = watchers[next(4)].lock();
+                        break;
+                    case 4:
+                        weak_slots[next(2)] = slot;
+                        break;
+                    case 5:
+                        slot = weak_slots[next(2)].lock();
+                        break;
+                    default:
+                        if (slot)
+                        {
+                            EXPECT_LE(0, int(*slot));
+                            EXPECT_GT(4, int(*slot));
+                        }
+                        break;
+                    }
+                }
+            });
+        }
+        while (started.load() != threads)
+        {
+            std::this_thread::yield();
+        }
+        owners.clear();
+        for (std::thread& worker : workers)
+        {
+            worker.join();
+        }
+    }
+}
+
+TEST(shared_ptr_testing, stress_multi_thread_policy)
+{
+    test_object::no_new_instances_guard g;
+    stress_ownership<multi_thread_policy>(8, 100000);
+    g.expect_no_instances();
+}
+
+TEST(shared_ptr_testing, stress_biased_policy)
+{
+    test_object::no_new_instances_guard g;
+    stress_ownership<biased_policy>(8, 100000);
+    // Blocks the workers dropped last wait for their owner, this thread.
+    biased_policy::drain();
+    g.expect_no_instances();
+}
+
+TEST(shared_ptr_testing, stress_deferred_policy)
+{
+    test_object::no_new_instances_guard g;
+    stress_ownership<deferred_policy>(8, 100000);
+    deferred_policy::drain();
+    g.expect_no_instances();
+}
+
+TEST(shared_ptr_testing, stress_atomic_cells)
+{
+    test_object::no_new_instances_guard g;
+    {
+        atomic_shared_ptr<test_object> cell(make_shared<test_object, multi_thread_policy>(0));
+        atomic_weak_ptr<test_object> weak_cell;
+        std::vector<std::thread> workers;
+        for (int t = 0; t != 8; ++t)
+        {
+            workers.emplace_back([&, t] {
+                for (int i = 0; i != 5000; ++i)
+                {
+                    switch ((i + t) % 4)
+                    {
+                    case 0:
+                        cell.store(make_shared<test_object, multi_thread_policy>(t));
+                        break;
+                    case 1:
+                        weak_cell.store(cell.load());
+                        break;
+                    case 2:
+                        if (shared_test_object p = weak_cell.load().lock())
+                        {
+                            EXPECT_GT(8, int(*p));
+                        }
+                        break;
+                    default:
+                        EXPECT_GT(8, int(*cell.load()));
+                        break;
+                    }
+                }
+            });
+        }
+        for (std::thread& worker : workers)
+        {
+            worker.join();
+        }
+    }
+    g.expect_no_instances();
+}
+
 int main(int argc, char** argv)
 {
     testing::InitGoogleTest(&argc, argv);
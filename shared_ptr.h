@@ -1 +1,4408 @@
 #pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace detail
+{
+    // What is left to do after a strong reference was dropped.
+    enum class released
+    {
+        // Other strong references remain.
+        none,
+        // The object has to be disposed, weak references remain.
+        last_strong,
+        // The object has to be disposed and the block freed.
+        last,
+    };
+}
+
+// Counting policies of shared_ptr/weak_ptr. Policy::counts holds the
+// strong and weak counts of a control block. weak includes one reference
+// on behalf of all strong references, so the block is freed only after the
+// object is disposed and the last weak_ptr is gone.
+
+// Counts that may be updated from any number of threads at once. Both live
+// in one 64-bit word, strong in the low half and weak in the high half.
+// Dropping the last strong reference tells from the value it replaced
+// whether any weak_ptr is left, and if none is, the block is freed without
+// touching the counts again.
+//
+// New references are taken with relaxed increments: whoever copies one
+// already holds one, so the count can't drop to zero meanwhile. Releases
+// are release operations, so that everything a thread did with the object
+// happens before the count goes down, and only the thread that sees it hit
+// zero issues the acquire fence that makes all of it visible before the
+// object is destroyed or the block freed.
+struct multi_thread_policy
+{
+    class counts
+    {
+    public:
+        void add_strong() noexcept
+        {
+            value.fetch_add(strong_one, std::memory_order_relaxed);
+        }
+
+        void add_weak() noexcept
+        {
+            value.fetch_add(weak_one, std::memory_order_relaxed);
+        }
+
+        bool try_add_strong() noexcept
+        {
+            std::uint64_t current = value.load(std::memory_order_relaxed);
+            while ((current & strong_mask) != 0)
+            {
+                if (value.compare_exchange_weak(current, current + strong_one, std::memory_order_relaxed))
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        detail::released release_strong() noexcept
+        {
+            std::uint64_t const old = value.fetch_sub(strong_one, std::memory_order_release);
+            if ((old & strong_mask) != strong_one)
+            {
+                return detail::released::none;
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            return old == (strong_one | weak_one) ? detail::released::last : detail::released::last_strong;
+        }
+
+        // Batched forms for holders of many references at once, such as
+        // atomic_shared_ptr.
+        void add_strong(std::uint32_t n) noexcept
+        {
+            value.fetch_add(n * strong_one, std::memory_order_relaxed);
+        }
+
+        detail::released release_strong(std::uint32_t n) noexcept
+        {
+            std::uint64_t const old = value.fetch_sub(n * strong_one, std::memory_order_release);
+            if ((old & strong_mask) != n * strong_one)
+            {
+                return detail::released::none;
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            return old == (n * strong_one | weak_one) ? detail::released::last : detail::released::last_strong;
+        }
+
+        void add_weak(std::uint32_t n) noexcept
+        {
+            value.fetch_add(n * weak_one, std::memory_order_relaxed);
+        }
+
+        // Adds n, or just one once the count is past half its range, so that
+        // the batches of many holders can't carry out of their half of the
+        // word. Returns how many were added.
+        std::uint32_t add_strong_up_to(std::uint32_t n) noexcept
+        {
+            std::uint64_t const old = value.fetch_add(n * strong_one, std::memory_order_relaxed);
+            if ((old & strong_mask) < batch_limit)
+            {
+                return n;
+            }
+            value.fetch_sub((n - 1) * strong_one, std::memory_order_relaxed);
+            return 1;
+        }
+
+        std::uint32_t add_weak_up_to(std::uint32_t n) noexcept
+        {
+            std::uint64_t const old = value.fetch_add(n * weak_one, std::memory_order_relaxed);
+            if (old / weak_one < batch_limit)
+            {
+                return n;
+            }
+            value.fetch_sub((n - 1) * weak_one, std::memory_order_relaxed);
+            return 1;
+        }
+
+        bool release_weak(std::uint32_t n) noexcept
+        {
+            if (value.fetch_sub(n * weak_one, std::memory_order_release) != n * weak_one)
+            {
+                return false;
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            return true;
+        }
+
+        // Returns true for the last reference of any kind.
+        bool release_weak() noexcept
+        {
+            if (value.fetch_sub(weak_one, std::memory_order_release) != weak_one)
+            {
+                return false;
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            return true;
+        }
+
+        long use_count() const noexcept
+        {
+            return static_cast<long>(value.load(std::memory_order_relaxed) & strong_mask);
+        }
+
+    private:
+        static constexpr std::uint64_t strong_one = 1;
+        static constexpr std::uint64_t strong_mask = 0xffffffff;
+        static constexpr std::uint64_t weak_one = strong_mask + 1;
+        // Leaves room for the batches added concurrently while past it.
+        static constexpr std::uint64_t batch_limit = std::uint64_t(1) << 31;
+
+        std::atomic<std::uint64_t> value{strong_one | weak_one};
+    };
+};
+
+// Plain integer counts for objects that never leave the thread that
+// created them, such as state owned by a single shard. Copies and releases
+// skip the lock-prefixed instructions; sharing such an object between
+// threads is a data race.
+struct single_thread_policy
+{
+    class counts
+    {
+    public:
+        void add_strong() noexcept
+        {
+            ++strong;
+        }
+
+        void add_weak() noexcept
+        {
+            ++weak;
+        }
+
+        bool try_add_strong() noexcept
+        {
+            if (strong == 0)
+            {
+                return false;
+            }
+            ++strong;
+            return true;
+        }
+
+        detail::released release_strong() noexcept
+        {
+            if (--strong != 0)
+            {
+                return detail::released::none;
+            }
+            return weak == 1 ? detail::released::last : detail::released::last_strong;
+        }
+
+        bool release_weak() noexcept
+        {
+            return --weak == 0;
+        }
+
+        long use_count() const noexcept
+        {
+            return static_cast<long>(strong);
+        }
+
+    private:
+        std::uint32_t strong = 1;
+        std::uint32_t weak = 1;
+    };
+};
+
+namespace detail
+{
+    class bias_owner;
+}
+
+// Biased reference counting. The thread that creates an object counts its
+// references in a plain integer, the biased count; all other threads use an
+// atomic shared count. When the owner drops its last biased reference, the
+// two counts are merged into the shared one, which every thread uses from
+// then on. A non-owner that takes the shared count below zero queues the
+// block to its owner, and the owner merges it on its next drain(): called
+// explicitly, whenever the owner creates another object with this policy,
+// and when the thread exits. Blocks queued after their owner has exited are
+// merged by the thread queuing them.
+//
+// Objects that stay on the thread that created them are copied almost as
+// cheaply as with single_thread_policy, and may still be shared with other
+// threads. When the owner drops a reference to a block another thread
+// queued, it merges its queue until the block is in it, waiting at most for
+// that thread to finish queuing; the block is then counted in the shared
+// count only, and disposed by whichever thread drops its last reference.
+//
+// The first block a thread creates also allocates the thread's owner
+// record, so that make_shared makes two allocations there instead of one;
+// attach() makes it ahead of time.
+struct biased_policy
+{
+    class counts;
+
+    // Makes the calling thread's owner record if it has none yet.
+    static void attach();
+
+    // Merges the blocks other threads queued to the calling thread. A block
+    // whose references all went to other threads and were dropped there is
+    // only disposed here, or when the owner makes another block or exits.
+    static void drain() noexcept;
+};
+
+namespace detail
+{
+    // The thread a biased block belongs to, and the queue other threads
+    // hand its blocks back through. Unmerged blocks keep the record alive,
+    // so it may outlive its thread.
+    class bias_owner
+    {
+    public:
+        using counts = biased_policy::counts;
+
+        bias_owner(bias_owner const&) = delete;
+        bias_owner& operator=(bias_owner const&) = delete;
+
+        // The calling thread's record, null if it has none.
+        static bias_owner* current() noexcept
+        {
+            return self;
+        }
+
+        // The calling thread's record, made on first use. Null once the
+        // thread started exiting.
+        static bias_owner* create()
+        {
+            if (!self && !exiting)
+            {
+                thread_local closer close_on_exit;
+                (void)close_on_exit;
+                self = new bias_owner();
+            }
+            return self;
+        }
+
+        // The calling thread's record for a new block, which takes a
+        // reference on it. Null once the thread started exiting.
+        static bias_owner* acquire()
+        {
+            if (!self)
+            {
+                if (!create())
+                {
+                    return nullptr;
+                }
+            }
+            else if (self->queue.load(std::memory_order_relaxed))
+            {
+                self->drain();
+            }
+            self->refs.fetch_add(1, std::memory_order_relaxed);
+            return self;
+        }
+
+        void release() noexcept
+        {
+            if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            {
+                delete this;
+            }
+        }
+
+        // Queues c for merging. Fails if the owner has exited, c is then
+        // the caller's to merge.
+        bool push(counts* c) noexcept;
+
+        void drain() noexcept
+        {
+            merge_all(queue.exchange(nullptr, std::memory_order_acquire));
+        }
+
+        // Drains until the blocks the owner merged while they were queued
+        // are out of the queue, including those the drain itself releases.
+        void drain_queued() noexcept
+        {
+            ++late;
+            for (;;)
+            {
+                drain();
+                if (!late)
+                {
+                    return;
+                }
+                std::this_thread::yield();
+            }
+        }
+
+    private:
+        struct closer
+        {
+            ~closer()
+            {
+                exiting = true;
+                std::exchange(self, nullptr)->close();
+            }
+        };
+
+        bias_owner() = default;
+
+        // Stands for a closed queue.
+        static counts* closed() noexcept
+        {
+            return reinterpret_cast<counts*>(alignof(std::max_align_t));
+        }
+
+        void close() noexcept
+        {
+            merge_all(queue.exchange(closed(), std::memory_order_acq_rel));
+            release();
+        }
+
+        static void merge_all(counts* list) noexcept;
+
+        static inline thread_local bias_owner* self = nullptr;
+        static inline thread_local bool exiting = false;
+
+        // The thread's own reference and one per unmerged block.
+        std::atomic<std::size_t> refs{1};
+        std::atomic<counts*> queue{nullptr};
+        // Blocks drain_queued() waits for; only the owner uses it.
+        std::size_t late = 0;
+    };
+}
+
+class biased_policy::counts
+{
+public:
+    counts()
+        : owner(detail::bias_owner::acquire())
+    {
+        if (!owner)
+        {
+            biased.store(0, std::memory_order_relaxed);
+            shared.store(one | merged, std::memory_order_relaxed);
+        }
+    }
+
+    counts(counts const&) = delete;
+    counts& operator=(counts const&) = delete;
+
+    // Blocks are merged before they're freed, unless the object failed to
+    // construct: the block then still holds its reference on the owner.
+    ~counts()
+    {
+        if (owner && !(shared.load(std::memory_order_relaxed) & merged))
+        {
+            owner->release();
+        }
+    }
+
+    void add_strong() noexcept
+    {
+        std::uint32_t const b = biased.load(std::memory_order_relaxed);
+        if (b != 0 && owned())
+        {
+            biased.store(b + 1, std::memory_order_relaxed);
+        }
+        else
+        {
+            shared.fetch_add(one, std::memory_order_relaxed);
+        }
+    }
+
+    void add_weak() noexcept
+    {
+        weak.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    bool try_add_strong() noexcept
+    {
+        std::uint32_t const b = biased.load(std::memory_order_relaxed);
+        if (b != 0 && owned())
+        {
+            if (b + count(shared.load(std::memory_order_relaxed)) <= 0)
+            {
+                return false;
+            }
+            biased.store(b + 1, std::memory_order_relaxed);
+            return true;
+        }
+        std::int64_t value = shared.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            std::int64_t total = count(value);
+            if (!(value & merged))
+            {
+                // The owner may be merging: if the biased count read
+                // here is already zero, the reload below sees the merge.
+                total += biased.load(std::memory_order_acquire);
+            }
+            if (total <= 0)
+            {
+                std::int64_t const again = shared.load(std::memory_order_relaxed);
+                if (again == value)
+                {
+                    return false;
+                }
+                value = again;
+            }
+            else if (shared.compare_exchange_weak(value, value + one, std::memory_order_relaxed))
+            {
+                return true;
+            }
+        }
+    }
+
+    detail::released release_strong() noexcept
+    {
+        std::uint32_t const b = biased.load(std::memory_order_relaxed);
+        if (b != 0 && owned())
+        {
+            if (b != 1 && !(shared.load(std::memory_order_relaxed) & queued))
+            {
+                biased.store(b - 1, std::memory_order_relaxed);
+                return detail::released::none;
+            }
+            // Merged here, ahead of the queue; the biased count is cleared
+            // last, as in merge().
+            std::int64_t const old =
+                shared.fetch_add(std::int64_t(b - 1) * one + merged, std::memory_order_release);
+            biased.store(0, std::memory_order_release);
+            if (old & queued)
+            {
+                owner->drain_queued();
+                return detail::released::none;
+            }
+            owner->release();
+            return settle(old | merged);
+        }
+        return release_shared();
+    }
+
+    bool release_weak() noexcept
+    {
+        if (weak.fetch_sub(1, std::memory_order_release) != 1)
+        {
+            return false;
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return true;
+    }
+
+    long use_count() const noexcept
+    {
+        return static_cast<long>(count(shared.load(std::memory_order_relaxed)) +
+                                 biased.load(std::memory_order_relaxed));
+    }
+
+private:
+    friend class detail::bias_owner;
+
+    // shared keeps the merged and queued flags in its low bits and the
+    // count, which may go negative before the merge, above them.
+    static constexpr std::int64_t merged = 1;
+    static constexpr std::int64_t queued = 2;
+    static constexpr std::int64_t one = 4;
+
+    static std::int64_t count(std::int64_t value) noexcept
+    {
+        return value >> 2;
+    }
+
+    bool owned() const noexcept
+    {
+        return owner == detail::bias_owner::current();
+    }
+
+    // A block is disposed by whoever leaves it merged, out of the queue
+    // and without references; a queued block waits for its merge. Ordered
+    // like multi_thread_policy: updates of shared release, and only the
+    // thread disposing the object acquires.
+    detail::released settle(std::int64_t value) const noexcept
+    {
+        if ((value & (merged | queued)) != merged || count(value) != 0)
+        {
+            return detail::released::none;
+        }
+        bool const last = weak.load(std::memory_order_relaxed) == 1;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return last ? detail::released::last : detail::released::last_strong;
+    }
+
+    detail::released release_shared() noexcept
+    {
+        std::int64_t value = shared.load(std::memory_order_relaxed);
+        if (value & merged)
+        {
+            return settle(shared.fetch_sub(one, std::memory_order_release) - one);
+        }
+        std::int64_t desired;
+        do
+        {
+            desired = value - one;
+            if (!(value & (merged | queued)) && count(desired) < 0)
+            {
+                desired |= queued;
+            }
+        } while (!shared.compare_exchange_weak(value, desired, std::memory_order_release,
+                                               std::memory_order_relaxed));
+
+        if ((desired & ~value) & queued)
+        {
+            return owner->push(this) ? detail::released::none : merge();
+        }
+        return settle(desired);
+    }
+
+    // Adds the biased count to the shared one and takes the block out of
+    // the queue. Runs on the owner, or after it has exited.
+    detail::released merge() noexcept
+    {
+        std::int64_t const value = shared.load(std::memory_order_relaxed);
+        std::int64_t const add = std::int64_t(biased.load(std::memory_order_relaxed)) * one - queued +
+                                 ((value & merged) ? 0 : merged);
+        std::int64_t const merged_value = shared.fetch_add(add, std::memory_order_release) + add;
+        biased.store(0, std::memory_order_release);
+        owner->release();
+        return settle(merged_value);
+    }
+
+    detail::bias_owner* const owner;
+    std::atomic<std::uint32_t> biased{1};
+    std::atomic<std::uint32_t> weak{1};
+    std::atomic<std::int64_t> shared{0};
+    counts* next = nullptr;
+};
+
+// Counts of multi_thread_policy, except that dropping the last strong
+// reference hands the block to a background reclaimer thread, which
+// disposes the object there instead of the releasing thread. Meant for
+// objects whose destructor would stall a latency-sensitive thread, such as
+// large trees. The reclaimer takes blocks in batches, in the order they
+// were released. weak_ptr::lock fails as soon as the last strong reference
+// is gone, even if the object is not destroyed yet.
+namespace detail
+{
+    class reclaimer;
+}
+
+struct deferred_policy
+{
+    class counts
+    {
+    public:
+        void add_strong() noexcept
+        {
+            shared.add_strong();
+        }
+
+        void add_weak() noexcept
+        {
+            shared.add_weak();
+        }
+
+        bool try_add_strong() noexcept
+        {
+            return shared.try_add_strong();
+        }
+
+        detail::released release_strong() noexcept;
+
+        bool release_weak() noexcept
+        {
+            return shared.release_weak();
+        }
+
+        long use_count() const noexcept
+        {
+            return shared.use_count();
+        }
+
+    private:
+        friend class detail::reclaimer;
+
+        multi_thread_policy::counts shared;
+        // Links the blocks queued to the reclaimer.
+        counts* next = nullptr;
+        detail::released result = detail::released::none;
+    };
+
+    // Waits until every object released so far is destroyed, along with
+    // those their destructors release in turn. Must not be called from a
+    // destructor the reclaimer runs.
+    static void drain();
+};
+
+// Counts of multi_thread_policy, for pointers whose destructors may run
+// inside a release_batch. Checking for one is a thread_local load on every
+// release, which plain multi_thread_policy pointers don't pay.
+struct batched_policy : multi_thread_policy
+{};
+
+namespace detail
+{
+    // Policy of shared_ptr<T>, weak_ptr<T> and thin_shared_ptr<T>. Define
+    // SHARED_PTR_SINGLE_THREAD to make it single_thread_policy, or
+    // SHARED_PTR_BIASED to make it biased_policy.
+#if defined(SHARED_PTR_SINGLE_THREAD)
+    using default_policy = single_thread_policy;
+#elif defined(SHARED_PTR_BIASED)
+    using default_policy = biased_policy;
+#else
+    using default_policy = multi_thread_policy;
+#endif
+}
+
+template <typename T, typename Policy = detail::default_policy>
+class shared_ptr;
+
+template <typename T, typename Policy = detail::default_policy>
+class weak_ptr;
+
+template <typename T>
+class thin_shared_ptr;
+
+// An atomic_shared_ptr drops the references it holds on a value as soon
+// as the value is replaced; see hazard_reclaim for the alternative.
+struct reclaim_now
+{};
+
+template <typename T, typename Reclaim = reclaim_now>
+class atomic_shared_ptr;
+
+template <typename T>
+class atomic_weak_ptr;
+
+// Pointers for objects confined to one thread, see single_thread_policy.
+template <typename T>
+using local_shared_ptr = shared_ptr<T, single_thread_policy>;
+
+template <typename T>
+using local_weak_ptr = weak_ptr<T, single_thread_policy>;
+
+namespace detail
+{
+    // Per-thread, size-classed free lists for small allocations such as
+    // control blocks. A thread allocates from its own pool without any
+    // synchronization. Memory freed on another thread is pushed onto a
+    // lock-free per-class list of the owning pool, which the owner takes
+    // over in one exchange once its local list runs dry. Pools of exited
+    // threads are adopted by new threads, slabs are never returned to the
+    // system.
+    class block_pool
+    {
+    public:
+        static constexpr std::size_t granularity = alignof(std::max_align_t);
+        static constexpr std::size_t class_count = 8;
+        static constexpr std::size_t max_size = granularity * class_count;
+
+        block_pool(block_pool const&) = delete;
+        block_pool& operator=(block_pool const&) = delete;
+
+        static void* allocate(std::size_t size)
+        {
+            if (size > max_size)
+            {
+                return ::operator new(size);
+            }
+            return local().pop(class_of(size));
+        }
+
+        static void deallocate(void* p, std::size_t size) noexcept
+        {
+            if (size > max_size)
+            {
+                ::operator delete(p);
+                return;
+            }
+            node* n = static_cast<node*>(static_cast<header*>(p) - 1);
+            block_pool* owner = n->owner;
+            if (owner == current)
+            {
+                owner->push_local(class_of(size), n);
+            }
+            else
+            {
+                owner->push_remote(class_of(size), n);
+            }
+        }
+
+    private:
+        // Prefix of every chunk, padded so the payload stays max-aligned.
+        struct alignas(std::max_align_t) header
+        {
+            block_pool* owner;
+        };
+
+        // A chunk on a free list reuses the payload for the link.
+        struct node : header
+        {
+            node* next;
+        };
+
+        struct size_class
+        {
+            node* free = nullptr;
+            std::atomic<node*> remote{nullptr};
+        };
+
+        static constexpr std::size_t chunks_per_slab = 64;
+
+        block_pool() = default;
+
+        static std::size_t class_of(std::size_t size) noexcept
+        {
+            return size == 0 ? 0 : (size - 1) / granularity;
+        }
+
+        static constexpr std::size_t chunk_size(std::size_t c) noexcept
+        {
+            return sizeof(header) + (c + 1) * granularity;
+        }
+
+        void* pop(std::size_t c)
+        {
+            size_class& sc = classes[c];
+            if (!sc.free)
+            {
+                sc.free = sc.remote.exchange(nullptr, std::memory_order_acquire);
+                if (!sc.free)
+                {
+                    refill(c);
+                }
+            }
+            node* n = sc.free;
+            sc.free = n->next;
+            return static_cast<header*>(n) + 1;
+        }
+
+        void push_local(std::size_t c, node* n) noexcept
+        {
+            n->next = classes[c].free;
+            classes[c].free = n;
+        }
+
+        void push_remote(std::size_t c, node* n) noexcept
+        {
+            std::atomic<node*>& remote = classes[c].remote;
+            n->next = remote.load(std::memory_order_relaxed);
+            while (!remote.compare_exchange_weak(n->next, n, std::memory_order_release,
+                                                 std::memory_order_relaxed))
+            {}
+        }
+
+        void refill(std::size_t c)
+        {
+            std::size_t const size = chunk_size(c);
+            auto* slab = static_cast<unsigned char*>(::operator new(size * chunks_per_slab));
+            for (std::size_t i = chunks_per_slab; i-- != 0;)
+            {
+                node* n = ::new (static_cast<void*>(slab + i * size)) node;
+                n->owner = this;
+                push_local(c, n);
+            }
+        }
+
+        struct registry
+        {
+            std::mutex mutex;
+            std::vector<block_pool*> orphans;
+        };
+
+        static registry& pools()
+        {
+            static registry* instance = new registry();
+            return *instance;
+        }
+
+        // Hands the pool of an exiting thread over to a future thread.
+        struct releaser
+        {
+            ~releaser()
+            {
+                registry& r = pools();
+                std::lock_guard<std::mutex> lock(r.mutex);
+                r.orphans.push_back(std::exchange(current, nullptr));
+            }
+        };
+
+        static block_pool& local()
+        {
+            if (!current)
+            {
+                thread_local releaser release_on_exit;
+                (void)release_on_exit;
+
+                registry& r = pools();
+                std::lock_guard<std::mutex> lock(r.mutex);
+                if (r.orphans.empty())
+                {
+                    current = new block_pool();
+                }
+                else
+                {
+                    current = r.orphans.back();
+                    r.orphans.pop_back();
+                }
+            }
+            return *current;
+        }
+
+        static inline thread_local block_pool* current = nullptr;
+
+        size_class classes[class_count];
+    };
+}
+
+// Stateless allocator serving small requests from detail::block_pool.
+// Passing it to shared_ptr(Y*, D, A) takes the control block from the
+// thread's pool instead of operator new; define SHARED_PTR_POOL_BLOCKS
+// to make it the default for shared_ptr(Y*) and shared_ptr(Y*, D).
+template <typename T>
+struct pool_allocator
+{
+    using value_type = T;
+
+    pool_allocator() noexcept = default;
+
+    template <typename U>
+    pool_allocator(pool_allocator<U> const&) noexcept
+    {}
+
+    // Checked here rather than on the class: shared_ptr(Y*) names
+    // pool_allocator<Y> even though it only allocates the rebound block.
+    T* allocate(std::size_t n)
+    {
+        static_assert(alignof(T) <= alignof(std::max_align_t), "over-aligned types are not supported");
+        return static_cast<T*>(detail::block_pool::allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, std::size_t n) noexcept
+    {
+        detail::block_pool::deallocate(p, n * sizeof(T));
+    }
+
+    template <typename U>
+    bool operator==(pool_allocator<U> const&) const noexcept
+    {
+        return true;
+    }
+
+    template <typename U>
+    bool operator!=(pool_allocator<U> const&) const noexcept
+    {
+        return false;
+    }
+};
+
+// Layout policy for make_shared/allocate_shared: the control block starts
+// on a cache line of its own, and the object on the next one. Counters of
+// objects created back to back never share a line, so threads updating
+// neighbouring objects' counts don't bounce the line between cores. Costs
+// up to two cache lines of padding per object.
+struct cache_line_isolated_t
+{
+    explicit cache_line_isolated_t() = default;
+};
+
+inline constexpr cache_line_isolated_t cache_line_isolated{};
+
+namespace detail
+{
+    inline constexpr std::size_t cache_line_size = 64;
+
+    // Alignment of the control block and the object for a layout policy.
+    template <typename Layout>
+    constexpr std::size_t layout_alignment = 1;
+
+    template <>
+    inline constexpr std::size_t layout_alignment<cache_line_isolated_t> = cache_line_size;
+
+#ifdef SHARED_PTR_POOL_BLOCKS
+    template <typename T>
+    using default_block_allocator = pool_allocator<T>;
+#else
+    template <typename T>
+    using default_block_allocator = std::allocator<T>;
+#endif
+
+    // Tag for constructors that take over a reference the caller already holds.
+    struct adopt_ref_t
+    {};
+
+    // Requests default-initialization instead of value-initialization:
+    // trivially constructible objects are left indeterminate.
+    struct default_init_t
+    {};
+
+    // Lets factory functions build a shared_ptr from a block they created.
+    struct ptr_access;
+
+    template <typename T>
+    constexpr bool is_unbounded_array_v = false;
+
+    template <typename T>
+    constexpr bool is_unbounded_array_v<T[]> = true;
+
+    template <typename T>
+    constexpr bool is_bounded_array_v = false;
+
+    template <typename T, std::size_t N>
+    constexpr bool is_bounded_array_v<T[N]> = true;
+
+    // shared_ptr<T> can be constructed from Y*: Y* converts to T*, or for
+    // T = U[] / U[N] the pointer is to an array of Y convertible to T.
+    template <typename Y, typename T>
+    constexpr bool accepts_pointer_v = std::is_convertible_v<Y*, T*>;
+
+    template <typename Y, typename U>
+    constexpr bool accepts_pointer_v<Y, U[]> = std::is_convertible_v<Y (*)[], U (*)[]>;
+
+    template <typename Y, typename U, std::size_t N>
+    constexpr bool accepts_pointer_v<Y, U[N]> = std::is_convertible_v<Y (*)[N], U (*)[N]>;
+
+    // shared_ptr<Y> converts to shared_ptr<T>; shared_ptr<U[N]> also
+    // converts to shared_ptr<U[]>.
+    template <typename Y, typename T>
+    constexpr bool is_compatible_v = std::is_convertible_v<Y*, T*>;
+
+    template <typename Y, std::size_t N, typename U>
+    constexpr bool is_compatible_v<Y[N], U[]> = std::is_convertible_v<Y (*)[N], U (*)[N]>;
+}
+
+// Strong count striped over shards on cache lines of their own, after
+// Linux's percpu_ref, for the few objects every thread copies all the
+// time, such as a logger or the current configuration. Each thread counts
+// on a shard of its own, so copies don't bounce one line between cores.
+// Sharded counts can't tell when they drop to zero: the object lives until
+// its owner calls collapse(), which folds the shards into a central count,
+// and then until its last reference is gone. Each block carries about a
+// kilobyte of shards.
+struct sharded_policy
+{
+    class counts;
+
+    // Switches p's block to its central count for teardown. Call it once,
+    // while p still owns the object; later calls do nothing.
+    template <typename T>
+    static void collapse(shared_ptr<T, sharded_policy> const& p) noexcept;
+};
+
+class sharded_policy::counts
+{
+public:
+    counts() = default;
+    counts(counts const&) = delete;
+    counts& operator=(counts const&) = delete;
+
+    void add_strong() noexcept
+    {
+        if (local().value.fetch_add(one, std::memory_order_relaxed) & dead)
+        {
+            central.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    void add_weak() noexcept
+    {
+        weak.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    bool try_add_strong() noexcept
+    {
+        // Until its shards are folded, the bias keeps the object alive.
+        if (!(local().value.fetch_add(one, std::memory_order_relaxed) & dead))
+        {
+            return true;
+        }
+        std::int64_t current = central.load(std::memory_order_relaxed);
+        while (current != 0)
+        {
+            if (central.compare_exchange_weak(current, current + 1, std::memory_order_relaxed))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    detail::released release_strong() noexcept
+    {
+        if (!(local().value.fetch_sub(one, std::memory_order_release) & dead))
+        {
+            return detail::released::none;
+        }
+        return release_central(1);
+    }
+
+    bool release_weak() noexcept
+    {
+        if (weak.fetch_sub(1, std::memory_order_release) != 1)
+        {
+            return false;
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return true;
+    }
+
+    // Exact only while no other thread copies or drops a reference.
+    long use_count() const noexcept
+    {
+        std::int64_t total = central.load(std::memory_order_relaxed);
+        for (shard const& s : shards)
+        {
+            std::int64_t const value = s.value.load(std::memory_order_relaxed);
+            if (!(value & dead))
+            {
+                total += value / one;
+            }
+        }
+        if (!collapsing.load(std::memory_order_relaxed))
+        {
+            total -= bias;
+        }
+        return static_cast<long>(total);
+    }
+
+    // Marks every shard dead and moves its count to central; references
+    // taken or dropped on a dead shard go to central instead. The bias
+    // holds central above zero until all shards are folded, whatever they
+    // held, and is dropped last.
+    void collapse() noexcept
+    {
+        if (collapsing.exchange(true, std::memory_order_relaxed))
+        {
+            return;
+        }
+        for (shard& s : shards)
+        {
+            central.fetch_add(s.value.exchange(dead, std::memory_order_acquire) / one, std::memory_order_relaxed);
+        }
+        // The caller's reference keeps the object alive.
+        (void)release_central(bias);
+    }
+
+private:
+    // Counters 64 bytes apart never share a line, however the block is
+    // aligned; over-aligning it instead would rule out pool_allocator.
+    struct shard
+    {
+        std::atomic<std::int64_t> value{0};
+        unsigned char padding[detail::cache_line_size - sizeof(std::atomic<std::int64_t>)];
+    };
+
+    static constexpr std::size_t shard_count = 16;
+    // Shards count in steps of one and keep the dead flag in the low bit.
+    static constexpr std::int64_t dead = 1;
+    static constexpr std::int64_t one = 2;
+    static constexpr std::int64_t bias = std::int64_t(1) << 40;
+
+    shard& local() noexcept
+    {
+        static std::atomic<std::size_t> next{0};
+        thread_local std::size_t const index = next.fetch_add(1, std::memory_order_relaxed) % shard_count;
+        return shards[index];
+    }
+
+    // Ordered like multi_thread_policy; collapse() acquires the shards'
+    // releases before its release of the bias.
+    detail::released release_central(std::int64_t n) noexcept
+    {
+        if (central.fetch_sub(n, std::memory_order_release) != n)
+        {
+            return detail::released::none;
+        }
+        bool const last = weak.load(std::memory_order_relaxed) == 1;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return last ? detail::released::last : detail::released::last_strong;
+    }
+
+    std::atomic<std::int64_t> central{bias + 1};
+    std::atomic<std::uint32_t> weak{1};
+    std::atomic<bool> collapsing{false};
+    unsigned char padding[detail::cache_line_size];
+    shard shards[shard_count];
+};
+
+// Pointers for hot shared objects, see sharded_policy.
+template <typename T>
+using hot_shared_ptr = shared_ptr<T, sharded_policy>;
+
+namespace detail
+{
+    template <typename Policy>
+    struct control_block;
+
+    // Hand-rolled dispatch table of a control block. Each block type has
+    // a single static instance, so comparing ops pointers tells the exact
+    // block type without RTTI.
+    template <typename Policy>
+    struct block_ops
+    {
+        // Destroys the managed object, the block itself stays alive.
+        void (*dispose)(control_block<Policy>*) noexcept;
+        // Frees the block once both counts reach zero.
+        void (*destroy)(control_block<Policy>*) noexcept;
+    };
+
+    template <typename T>
+    void* to_void(T* ptr) noexcept
+    {
+        return const_cast<void*>(static_cast<void const volatile*>(ptr));
+    }
+
+    // Reference counts shared by all shared_ptr/weak_ptr instances owning
+    // the same object, kept as Policy says. The block also knows the
+    // address of the object it owns, which lets thin_shared_ptr get by with
+    // the block pointer alone.
+    template <typename Policy>
+    struct control_block
+    {
+        control_block(block_ops<Policy> const* ops, void* object) noexcept
+            : ops(ops)
+            , object(object)
+        {}
+
+        control_block(control_block const&) = delete;
+        control_block& operator=(control_block const&) = delete;
+
+        void add_strong() noexcept
+        {
+            counts.add_strong();
+        }
+
+        void add_weak() noexcept
+        {
+            counts.add_weak();
+        }
+
+        // Only policies providing the batched counts support these.
+        void add_strong(std::uint32_t n) noexcept
+        {
+            counts.add_strong(n);
+        }
+
+        void release_strong(std::uint32_t n) noexcept
+        {
+            finish_release(counts.release_strong(n));
+        }
+
+        void add_weak(std::uint32_t n) noexcept
+        {
+            counts.add_weak(n);
+        }
+
+        std::uint32_t add_strong_up_to(std::uint32_t n) noexcept
+        {
+            return counts.add_strong_up_to(n);
+        }
+
+        std::uint32_t add_weak_up_to(std::uint32_t n) noexcept
+        {
+            return counts.add_weak_up_to(n);
+        }
+
+        void release_weak(std::uint32_t n) noexcept
+        {
+            if (counts.release_weak(n))
+            {
+                ops->destroy(this);
+            }
+        }
+
+        bool try_add_strong() noexcept
+        {
+            return counts.try_add_strong();
+        }
+
+        // Expected lists block types the caller is likely to own. If the
+        // block turns out to be one of them, its dispose/destroy are called
+        // directly, otherwise through ops.
+        template <typename... Expected>
+        void release_strong() noexcept
+        {
+            released const result = counts.release_strong();
+            if (result != released::none && !(release_last_strong_as<Expected>(result) || ...))
+            {
+                finish_release(result);
+            }
+        }
+
+        // Disposes the object and frees the block as result asks. Policies
+        // that settle a release later, like biased_policy, call it directly.
+        void finish_release(released result) noexcept
+        {
+            if (result != released::none)
+            {
+                ops->dispose(this);
+                if (result == released::last || counts.release_weak())
+                {
+                    ops->destroy(this);
+                }
+            }
+        }
+
+        void release_weak() noexcept
+        {
+            if (counts.release_weak())
+            {
+                ops->destroy(this);
+            }
+        }
+
+        long use_count() const noexcept
+        {
+            return counts.use_count();
+        }
+
+        void* pointer() const noexcept
+        {
+            return object;
+        }
+
+        template <typename Block>
+        bool is() const noexcept
+        {
+            return ops == &Block::table;
+        }
+
+        // For operations of a policy's own, such as sharded_policy::collapse.
+        typename Policy::counts& policy_counts() noexcept
+        {
+            return counts;
+        }
+
+        // The block c belongs to; the counts are the first member.
+        static control_block* of(typename Policy::counts* c) noexcept
+        {
+            static_assert(std::is_standard_layout_v<control_block>);
+            return reinterpret_cast<control_block*>(c);
+        }
+
+    private:
+        template <typename Block>
+        bool release_last_strong_as(released result) noexcept
+        {
+            if (!is<Block>())
+            {
+                return false;
+            }
+            Block::dispose(this);
+            if (result == released::last || counts.release_weak())
+            {
+                Block::destroy(this);
+            }
+            return true;
+        }
+
+        typename Policy::counts counts;
+        block_ops<Policy> const* ops;
+        void* object;
+    };
+
+    // Holds a deleter or an allocator. Empty types are stored as a base
+    // class, so stateless deleters and allocators take no space in a block.
+    // Index tells apart two members of the same type.
+    template <typename T, int Index, bool = std::is_empty_v<T> && !std::is_final_v<T>>
+    struct ebo_storage
+    {
+        explicit ebo_storage(T value)
+            : value(std::move(value))
+        {}
+
+        T& get() noexcept
+        {
+            return value;
+        }
+
+    private:
+        T value;
+    };
+
+    template <typename T, int Index>
+    struct ebo_storage<T, Index, true> : private T
+    {
+        explicit ebo_storage(T value)
+            : T(std::move(value))
+        {}
+
+        T& get() noexcept
+        {
+            return *this;
+        }
+    };
+
+    // Allocates a Block through A rebound to Block and constructs it in place.
+    template <typename Block, typename A, typename... Args>
+    Block* allocate_block(A const& allocator, Args&&... args)
+    {
+        using block_allocator = typename std::allocator_traits<A>::template rebind_alloc<Block>;
+        using traits = std::allocator_traits<block_allocator>;
+
+        block_allocator a(allocator);
+        Block* block = traits::allocate(a, 1);
+        try
+        {
+            return ::new (static_cast<void*>(block)) Block(std::forward<Args>(args)...);
+        }
+        catch (...)
+        {
+            traits::deallocate(a, block, 1);
+            throw;
+        }
+    }
+
+    // Destroys a Block created by allocate_block, A is the block's own copy
+    // of the allocator.
+    template <typename Block, typename A>
+    void deallocate_block(Block* block, A& allocator) noexcept
+    {
+        using block_allocator = typename std::allocator_traits<A>::template rebind_alloc<Block>;
+
+        block_allocator a(allocator);
+        block->~Block();
+        std::allocator_traits<block_allocator>::deallocate(a, block, 1);
+    }
+
+    // Block for shared_ptr(Y*, D, A): the object lives in a separate
+    // allocation, the block is allocated through A.
+    template <typename Y, typename D, typename A, typename Policy>
+    struct ptr_block final
+        : control_block<Policy>
+        , private ebo_storage<D, 0>
+        , private ebo_storage<A, 1>
+    {
+        using base = control_block<Policy>;
+
+        ptr_block(Y* ptr, D deleter, A allocator)
+            : base(&table, to_void(ptr))
+            , ebo_storage<D, 0>(std::move(deleter))
+            , ebo_storage<A, 1>(std::move(allocator))
+        {}
+
+        static void dispose(base* cb) noexcept
+        {
+            auto* self = static_cast<ptr_block*>(cb);
+            self->deleter()(static_cast<Y*>(self->base::pointer()));
+        }
+
+        // Out of line: release_last_strong_as calls it on a guessed type, and
+        // inlining the deallocation there trips GCC's bounds analysis.
+        [[gnu::noinline]] static void destroy(base* cb) noexcept
+        {
+            auto* self = static_cast<ptr_block*>(cb);
+            A allocator(std::move(self->allocator()));
+            deallocate_block(self, allocator);
+        }
+
+        static constexpr block_ops<Policy> table{&dispose, &destroy};
+
+    private:
+        D& deleter() noexcept
+        {
+            return ebo_storage<D, 0>::get();
+        }
+
+        A& allocator() noexcept
+        {
+            return ebo_storage<A, 1>::get();
+        }
+    };
+
+    // Block for allocate_shared/make_shared: the object is embedded right
+    // after the counts, so the block and the object come from a single
+    // allocation made through A rebound to the block type. The object is
+    // constructed and destroyed through A rebound to T. Layout may ask for
+    // stricter alignment of the block and the object.
+    template <typename T, typename A, typename Policy, typename Layout = void>
+    struct inplace_block final
+        : control_block<Policy>
+        , private ebo_storage<A, 0>
+    {
+        using base = control_block<Policy>;
+
+        template <typename... Args>
+        explicit inplace_block(A allocator, Args&&... args)
+            : base(&table, storage)
+            , ebo_storage<A, 0>(std::move(allocator))
+        {
+            object_allocator a(this->allocator());
+            object_traits::construct(a, reinterpret_cast<value_type*>(storage), std::forward<Args>(args)...);
+        }
+
+        inplace_block(default_init_t, A allocator)
+            : base(&table, storage)
+            , ebo_storage<A, 0>(std::move(allocator))
+        {
+            ::new (static_cast<void*>(storage)) value_type;
+        }
+
+        T* get() noexcept
+        {
+            return std::launder(reinterpret_cast<T*>(storage));
+        }
+
+        static void dispose(base* cb) noexcept
+        {
+            auto* self = static_cast<inplace_block*>(cb);
+            object_allocator a(self->allocator());
+            object_traits::destroy(a, std::launder(reinterpret_cast<value_type*>(self->storage)));
+        }
+
+        // Out of line for the same reason as ptr_block::destroy.
+        [[gnu::noinline]] static void destroy(base* cb) noexcept
+        {
+            auto* self = static_cast<inplace_block*>(cb);
+            A allocator(std::move(self->allocator()));
+            deallocate_block(self, allocator);
+        }
+
+        static constexpr block_ops<Policy> table{&dispose, &destroy};
+
+    private:
+        using value_type = std::remove_cv_t<T>;
+        using object_allocator = typename std::allocator_traits<A>::template rebind_alloc<value_type>;
+        using object_traits = std::allocator_traits<object_allocator>;
+
+        A& allocator() noexcept
+        {
+            return ebo_storage<A, 0>::get();
+        }
+
+        alignas(std::max(alignof(T), layout_alignment<Layout>)) unsigned char storage[sizeof(T)];
+    };
+
+    // Block for allocate_shared<T[]>/make_shared<T[]>: the element count,
+    // the reference counts and the elements share a single allocation,
+    // sized at run time. Elements are destroyed in reverse order.
+    template <typename T, typename A, typename Policy>
+    struct inplace_array_block final
+        : control_block<Policy>
+        , private ebo_storage<A, 0>
+    {
+        using base = control_block<Policy>;
+
+        // Constructs count elements from init..., value-initialized when
+        // init is empty and default-initialized for default_init_t.
+        template <typename... Init>
+        static inplace_array_block* create(A const& allocator, std::size_t count, Init const&... init)
+        {
+            unit_allocator a(allocator);
+            std::size_t const n = units(count);
+            unit* memory = unit_traits::allocate(a, n);
+            auto* block = ::new (static_cast<void*>(memory)) inplace_array_block(allocator, count);
+            try
+            {
+                block->construct(init...);
+            }
+            catch (...)
+            {
+                block->~inplace_array_block();
+                unit_traits::deallocate(a, memory, n);
+                throw;
+            }
+            return block;
+        }
+
+        T* get() noexcept
+        {
+            return static_cast<T*>(base::pointer());
+        }
+
+        static void dispose(base* cb) noexcept
+        {
+            auto* self = static_cast<inplace_array_block*>(cb);
+            self->destroy_elements(self->count);
+        }
+
+        static void destroy(base* cb) noexcept
+        {
+            auto* self = static_cast<inplace_array_block*>(cb);
+            unit_allocator a(self->allocator());
+            std::size_t const n = units(self->count);
+            self->~inplace_array_block();
+            unit_traits::deallocate(a, reinterpret_cast<unit*>(self), n);
+        }
+
+        static constexpr block_ops<Policy> table{&dispose, &destroy};
+
+    private:
+        using value_type = std::remove_cv_t<T>;
+        using object_allocator = typename std::allocator_traits<A>::template rebind_alloc<value_type>;
+        using object_traits = std::allocator_traits<object_allocator>;
+
+        static constexpr std::size_t alignment = std::max(alignof(base), alignof(T));
+
+        // Allocation granule, keeps the block and the elements aligned.
+        struct alignas(alignment) unit
+        {
+            unsigned char bytes[alignment];
+        };
+
+        using unit_allocator = typename std::allocator_traits<A>::template rebind_alloc<unit>;
+        using unit_traits = std::allocator_traits<unit_allocator>;
+
+        static std::size_t elements_offset() noexcept
+        {
+            return (sizeof(inplace_array_block) + alignof(T) - 1) / alignof(T) * alignof(T);
+        }
+
+        static std::size_t units(std::size_t count) noexcept
+        {
+            return (elements_offset() + count * sizeof(T) + sizeof(unit) - 1) / sizeof(unit);
+        }
+
+        inplace_array_block(A const& allocator, std::size_t count) noexcept
+            : base(&table, reinterpret_cast<unsigned char*>(this) + elements_offset())
+            , ebo_storage<A, 0>(allocator)
+            , count(count)
+        {}
+
+        template <typename... Init>
+        void construct(Init const&... init)
+        {
+            auto* elements = static_cast<value_type*>(base::pointer());
+            if constexpr (std::is_same_v<object_allocator, std::allocator<value_type>>)
+            {
+                // The standard algorithms turn into memset or nothing at
+                // all for trivial types.
+                construct_n(elements, init...);
+                return;
+            }
+            object_allocator a(allocator());
+            std::size_t i = 0;
+            try
+            {
+                for (; i != count; ++i)
+                {
+                    construct_at(a, elements + i, init...);
+                }
+            }
+            catch (...)
+            {
+                destroy_elements(i);
+                throw;
+            }
+        }
+
+        void construct_n(value_type* elements)
+        {
+            std::uninitialized_value_construct_n(elements, count);
+        }
+
+        void construct_n(value_type* elements, value_type const& init)
+        {
+            std::uninitialized_fill_n(elements, count, init);
+        }
+
+        void construct_n(value_type* elements, default_init_t)
+        {
+            std::uninitialized_default_construct_n(elements, count);
+        }
+
+        template <typename... Init>
+        static void construct_at(object_allocator& a, value_type* p, Init const&... init)
+        {
+            object_traits::construct(a, p, init...);
+        }
+
+        static void construct_at(object_allocator&, value_type* p, default_init_t)
+        {
+            ::new (static_cast<void*>(p)) value_type;
+        }
+
+        void destroy_elements(std::size_t constructed) noexcept
+        {
+            object_allocator a(allocator());
+            auto* elements = static_cast<value_type*>(base::pointer());
+            while (constructed != 0)
+            {
+                object_traits::destroy(a, elements + --constructed);
+            }
+        }
+
+        A& allocator() noexcept
+        {
+            return ebo_storage<A, 0>::get();
+        }
+
+        std::size_t const count;
+    };
+
+    // thin_shared_ptr always counts with the default policy.
+    using thin_block = control_block<default_policy>;
+
+    // Block of a thin_shared_ptr or atomic_shared_ptr whose pointer
+    // differs from the one its owning block knows about, e.g. after
+    // aliasing or a conversion to a base at a non-zero offset. Holds one
+    // strong reference on the owner.
+    template <typename Policy>
+    struct alias_block final : control_block<Policy>
+    {
+        using base = control_block<Policy>;
+
+        alias_block(base* owner, void* object) noexcept
+            : base(&table, object)
+            , owner(owner)
+        {}
+
+        static void dispose(base* cb) noexcept
+        {
+            static_cast<alias_block*>(cb)->owner->release_strong();
+        }
+
+        static void destroy(base* cb) noexcept
+        {
+            default_block_allocator<alias_block> allocator;
+            deallocate_block(static_cast<alias_block*>(cb), allocator);
+        }
+
+        static constexpr block_ops<Policy> table{&dispose, &destroy};
+
+        base* const owner;
+    };
+
+    // The block owning the object: the aliased one for an alias_block, cb
+    // itself otherwise.
+    template <typename Policy>
+    control_block<Policy>* owner_of(control_block<Policy>* cb) noexcept
+    {
+        if (cb && cb->template is<alias_block<Policy>>())
+        {
+            return static_cast<alias_block<Policy>*>(cb)->owner;
+        }
+        return cb;
+    }
+
+    // Moves one strong reference from cb to the block owning its object.
+    template <typename Policy>
+    control_block<Policy>* unwrap_alias(control_block<Policy>* cb) noexcept
+    {
+        control_block<Policy>* owner = owner_of(cb);
+        if (owner != cb)
+        {
+            owner->add_strong();
+            cb->release_strong();
+        }
+        return owner;
+    }
+
+    // Turns one strong reference on cb into a block that points to ptr,
+    // allocating an alias_block only when cb points elsewhere.
+    template <typename Policy>
+    control_block<Policy>* make_thin(void* ptr, control_block<Policy>* cb)
+    {
+        if (!cb || cb->pointer() == ptr)
+        {
+            return cb;
+        }
+        cb = unwrap_alias(cb);
+        if (cb->pointer() == ptr)
+        {
+            return cb;
+        }
+        try
+        {
+            using block = alias_block<Policy>;
+            return allocate_block<block>(default_block_allocator<block>(), cb, ptr);
+        }
+        catch (...)
+        {
+            cb->release_strong();
+            throw;
+        }
+    }
+
+    // Block an atomic_weak_ptr stores for a weak_ptr whose pointer differs
+    // from the one its owner knows about. Holds one weak reference on the
+    // owner and is only ever weakly referenced itself.
+    template <typename Policy>
+    struct weak_alias_block final : control_block<Policy>
+    {
+        using base = control_block<Policy>;
+
+        weak_alias_block(base* owner, void* object) noexcept
+            : base(&table, object)
+            , owner(owner)
+        {}
+
+        static void dispose(base*) noexcept
+        {}
+
+        static void destroy(base* cb) noexcept
+        {
+            base* const owner = static_cast<weak_alias_block*>(cb)->owner;
+            default_block_allocator<weak_alias_block> allocator;
+            deallocate_block(static_cast<weak_alias_block*>(cb), allocator);
+            owner->release_weak();
+        }
+
+        static constexpr block_ops<Policy> table{&dispose, &destroy};
+
+        base* const owner;
+    };
+
+    template <typename Policy>
+    control_block<Policy>* weak_owner_of(control_block<Policy>* cb) noexcept
+    {
+        if (cb && cb->template is<weak_alias_block<Policy>>())
+        {
+            return static_cast<weak_alias_block<Policy>*>(cb)->owner;
+        }
+        return cb;
+    }
+
+    // Moves one weak reference from cb to the block owning its object.
+    template <typename Policy>
+    control_block<Policy>* unwrap_weak_alias(control_block<Policy>* cb) noexcept
+    {
+        control_block<Policy>* owner = weak_owner_of(cb);
+        if (owner != cb)
+        {
+            owner->add_weak();
+            cb->release_weak();
+        }
+        return owner;
+    }
+
+    // make_thin for a weak reference on cb.
+    template <typename Policy>
+    control_block<Policy>* make_weak_thin(void* ptr, control_block<Policy>* cb)
+    {
+        if (!cb || cb->pointer() == ptr)
+        {
+            return cb;
+        }
+        using block = weak_alias_block<Policy>;
+        block* alias;
+        try
+        {
+            alias = allocate_block<block>(default_block_allocator<block>(), cb, ptr);
+        }
+        catch (...)
+        {
+            cb->release_weak();
+            throw;
+        }
+        // Drops the strong reference the block starts with, leaving it with
+        // the caller's weak one.
+        alias->add_weak();
+        alias->release_strong();
+        return alias;
+    }
+
+    // The references a split_ref_cell hands out.
+    struct strong_refs
+    {
+        static void add(control_block<multi_thread_policy>* cb, std::uint32_t n) noexcept
+        {
+            cb->add_strong(n);
+        }
+
+        static std::uint32_t add_up_to(control_block<multi_thread_policy>* cb, std::uint32_t n) noexcept
+        {
+            return cb->add_strong_up_to(n);
+        }
+
+        static void release(control_block<multi_thread_policy>* cb, std::uint32_t n) noexcept
+        {
+            cb->release_strong(n);
+        }
+    };
+
+    struct weak_refs
+    {
+        static void add(control_block<multi_thread_policy>* cb, std::uint32_t n) noexcept
+        {
+            cb->add_weak(n);
+        }
+
+        static std::uint32_t add_up_to(control_block<multi_thread_policy>* cb, std::uint32_t n) noexcept
+        {
+            return cb->add_weak_up_to(n);
+        }
+
+        static void release(control_block<multi_thread_policy>* cb, std::uint32_t n) noexcept
+        {
+            cb->release_weak(n);
+        }
+    };
+
+    // Lock-free cell holding one reference, strong or weak as Refs says, on
+    // a block of multi_thread_policy. It is a single word: the block pointer
+    // in the low 48 bits and a slot count in the high 16.
+    //
+    // Every block stored comes with a batch of references added up front,
+    // and taking one is a single fetch_add on the slot count, as long as
+    // the batch lasts. The first slot past the batch adds a new one, and
+    // takes that come after it, before it's done, pay for their own
+    // reference. Replacing the block gives back what is left of the batch,
+    // or pays for slots past it, so the count stays exact whatever a stalled
+    // take finds when it resumes. A block whose count is past half its range
+    // is stored with a batch of one, flagged in the low pointer bit, so that
+    // many cells can't overflow it. Unless Reclaim is reclaim_now, the last
+    // reference the cell held goes through Reclaim::retire.
+    template <typename Refs, typename Reclaim = reclaim_now>
+    class split_ref_cell
+    {
+    public:
+        using block = control_block<multi_thread_policy>;
+
+        constexpr split_ref_cell() noexcept = default;
+
+        // Takes over the caller's reference on cb.
+        explicit split_ref_cell(block* cb) noexcept
+            : word(pack(cb))
+        {}
+
+        split_ref_cell(split_ref_cell const&) = delete;
+        split_ref_cell& operator=(split_ref_cell const&) = delete;
+
+        ~split_ref_cell()
+        {
+            give_back(word.load(std::memory_order_relaxed), 0);
+        }
+
+        // Returns a reference on the current block. Acquire.
+        block* take() const noexcept
+        {
+            std::uint64_t const old = word.fetch_add(slot_one, std::memory_order_acquire);
+            block* const cb = block_of(old);
+            int const slot = slot_of(old);
+            int const size = batch_of(old);
+            if (!cb || slot < size)
+            {
+                return cb;
+            }
+            // Past the batch: whoever replaces the block pays for this slot,
+            // so the block is alive, but the slot has to be paid for or
+            // handed back if it is still in the cell.
+            std::uint32_t const paid = slot == size ? size : 1;
+            Refs::add(cb, paid);
+            std::uint64_t current = word.load(std::memory_order_relaxed);
+            // The first slot past the batch stays above it until it is paid.
+            while (block_of(current) == cb && (paid == 1 || slot_of(current) > size))
+            {
+                if (word.compare_exchange_weak(current, current - paid * slot_one, std::memory_order_relaxed))
+                {
+                    return cb;
+                }
+            }
+            Refs::release(cb, paid);
+            return cb;
+        }
+
+        // The current block, without a reference. Sequentially consistent,
+        // like the stores, for hazard_pointer.
+        block* peek() const noexcept
+        {
+            return block_of(word.load());
+        }
+
+        // Stores cb, taking over the caller's reference, and returns one on
+        // the block it replaced.
+        block* exchange(block* cb) noexcept
+        {
+            std::uint64_t const old = word.exchange(pack(cb));
+            give_back(old, 1);
+            return block_of(old);
+        }
+
+        // Stores desired if the cell holds expected, and only then takes
+        // over the caller's reference on desired.
+        bool compare_exchange(block* expected, block* desired) noexcept
+        {
+            std::uint64_t const next = pack(desired);
+            std::uint64_t old = word.load(std::memory_order_relaxed);
+            while (block_of(old) == expected)
+            {
+                if (word.compare_exchange_weak(old, next, std::memory_order_seq_cst, std::memory_order_relaxed))
+                {
+                    give_back(old, 0);
+                    return true;
+                }
+            }
+            if (desired)
+            {
+                Refs::release(desired, batch_of(next));
+            }
+            return false;
+        }
+
+        static void drop(block* cb) noexcept
+        {
+            if (cb)
+            {
+                Refs::release(cb, 1);
+            }
+        }
+
+    private:
+        static_assert(sizeof(void*) == sizeof(std::uint64_t), "the slot count lives in unused pointer bits");
+
+        static constexpr int slot_shift = 48;
+        static constexpr std::uint64_t slot_one = std::uint64_t(1) << slot_shift;
+        // Set when the block was stored with a single reference.
+        static constexpr std::uint64_t single = 1;
+        static constexpr std::uint64_t pointer_mask = (slot_one - 1) & ~single;
+        // References a block is stored with, taken one per slot.
+        static constexpr int batch = 1 << 14;
+
+        static_assert(alignof(block) > single, "the single flag lives in an unused pointer bit");
+
+        static block* block_of(std::uint64_t w) noexcept
+        {
+            return reinterpret_cast<block*>(static_cast<std::uintptr_t>(w & pointer_mask));
+        }
+
+        static int batch_of(std::uint64_t w) noexcept
+        {
+            return (w & single) ? 1 : batch;
+        }
+
+        // Signed, as takes that resume after their block was replaced and
+        // stored again may take the count below zero.
+        static int slot_of(std::uint64_t w) noexcept
+        {
+            return static_cast<std::int16_t>(w >> slot_shift);
+        }
+
+        static std::uint64_t pack(block* cb) noexcept
+        {
+            std::uint64_t const w = reinterpret_cast<std::uintptr_t>(cb);
+            if (cb && Refs::add_up_to(cb, batch) != std::uint32_t(batch))
+            {
+                return w | single;
+            }
+            return w;
+        }
+
+        // Settles the references the cell held on w's block once w has left
+        // it, keeping keep of them for the caller.
+        static void give_back(std::uint64_t w, int keep) noexcept
+        {
+            block* const cb = block_of(w);
+            if (!cb)
+            {
+                return;
+            }
+            int const left = 1 + batch_of(w) - slot_of(w) - keep;
+            if constexpr (std::is_same_v<Reclaim, reclaim_now>)
+            {
+                settle(cb, left);
+            }
+            else
+            {
+                settle(cb, left - 1);
+                Reclaim::retire(cb);
+            }
+        }
+
+        // Releases n references, or adds -n if n is negative.
+        static void settle(block* cb, int n) noexcept
+        {
+            if (n > 0)
+            {
+                Refs::release(cb, static_cast<std::uint32_t>(n));
+            }
+            else if (n < 0)
+            {
+                Refs::add(cb, static_cast<std::uint32_t>(-n));
+            }
+        }
+
+        mutable std::atomic<std::uint64_t> word{0};
+    };
+
+    // Blocks a shared_ptr<T> most likely points to: the ones created by
+    // make_shared<T> and shared_ptr<T>(new T). Releasing them skips the
+    // indirect call through block_ops.
+    template <typename T, typename Policy, typename = void>
+    struct release_as
+    {
+        void operator()(control_block<Policy>* cb) const noexcept
+        {
+            cb->release_strong();
+        }
+    };
+
+    template <typename T, typename Policy>
+    struct release_as<T, Policy, std::enable_if_t<std::is_object_v<T> && !std::is_array_v<T>>>
+    {
+        void operator()(control_block<Policy>* cb) const noexcept
+        {
+            using object_type = std::remove_cv_t<T>;
+            cb->template release_strong<inplace_block<object_type, std::allocator<object_type>, Policy>,
+                                        ptr_block<object_type, std::default_delete<object_type>,
+                                                  default_block_allocator<object_type>, Policy>>();
+        }
+    };
+}
+
+namespace detail
+{
+    inline bool bias_owner::push(counts* c) noexcept
+    {
+        counts* head = queue.load(std::memory_order_acquire);
+        do
+        {
+            if (head == closed())
+            {
+                return false;
+            }
+            c->next = head;
+        } while (!queue.compare_exchange_weak(head, c, std::memory_order_release, std::memory_order_acquire));
+        return true;
+    }
+
+    inline void bias_owner::merge_all(counts* list) noexcept
+    {
+        while (list)
+        {
+            counts* c = std::exchange(list, list->next);
+            if (c->shared.load(std::memory_order_relaxed) & counts::merged)
+            {
+                --c->owner->late;
+            }
+            control_block<biased_policy>::of(c)->finish_release(c->merge());
+        }
+    }
+}
+
+inline void biased_policy::attach()
+{
+    detail::bias_owner::create();
+}
+
+inline void biased_policy::drain() noexcept
+{
+    if (detail::bias_owner* owner = detail::bias_owner::current())
+    {
+        owner->drain();
+    }
+}
+
+namespace detail
+{
+    // The thread deferred_policy hands blocks to, started by the first one.
+    // Blocks are queued on a lock-free stack linked through their counts;
+    // only the push that finds it empty takes the mutex, to wake the thread.
+    // At exit it finishes the blocks queued so far; blocks released after
+    // that are disposed inline. It is never destroyed, so that threads
+    // still releasing blocks then don't use a destroyed mutex.
+    class reclaimer
+    {
+    public:
+        using block = control_block<deferred_policy>;
+
+        reclaimer(reclaimer const&) = delete;
+        reclaimer& operator=(reclaimer const&) = delete;
+
+        static reclaimer& instance()
+        {
+            alignas(reclaimer) static unsigned char storage[sizeof(reclaimer)];
+            static reclaimer& r = *new (storage) reclaimer();
+            return r;
+        }
+
+        static void push(block* cb, released result) noexcept
+        {
+            if (stopped.load())
+            {
+                cb->finish_release(result);
+                return;
+            }
+            deferred_policy::counts& c = cb->policy_counts();
+            c.result = result;
+            // Once pushed, the block may be gone: only old is read after.
+            deferred_policy::counts* old = head.load(std::memory_order_relaxed);
+            do
+            {
+                c.next = old;
+            } while (!head.compare_exchange_weak(old, &c, std::memory_order_seq_cst, std::memory_order_relaxed));
+            // Either the destructor's last exchange sees this push, or this
+            // sees stopped.
+            if (stopped.load())
+            {
+                finish(head.exchange(nullptr, std::memory_order_acquire));
+            }
+            else if (!old)
+            {
+                instance().wake_worker();
+            }
+        }
+
+        void drain()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            idle.wait(lock, [this] { return !head.load(std::memory_order_acquire) && !busy; });
+        }
+
+    private:
+        reclaimer()
+        {
+            std::atexit(stop);
+        }
+
+        static void stop() noexcept
+        {
+            reclaimer& r = instance();
+            {
+                std::lock_guard<std::mutex> lock(r.mutex);
+                r.stopping = true;
+                stopped.store(true);
+            }
+            r.wake.notify_one();
+            if (r.worker.joinable())
+            {
+                r.worker.join();
+            }
+            finish(head.exchange(nullptr));
+        }
+
+        void wake_worker() noexcept
+        {
+            try
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!worker.joinable() && !stopping)
+                {
+                    worker = std::thread(&reclaimer::run, this);
+                }
+            }
+            catch (...)
+            {
+                // No thread to hand them to.
+                finish(head.exchange(nullptr, std::memory_order_acquire));
+                idle.notify_all();
+                return;
+            }
+            wake.notify_one();
+        }
+
+        // Finishes a popped stack, oldest push first.
+        static void finish(deferred_policy::counts* list) noexcept
+        {
+            deferred_policy::counts* ordered = nullptr;
+            while (list)
+            {
+                deferred_policy::counts* const next = list->next;
+                list->next = ordered;
+                ordered = list;
+                list = next;
+            }
+            while (ordered)
+            {
+                deferred_policy::counts* const c = std::exchange(ordered, ordered->next);
+                block::of(c)->finish_release(c->result);
+            }
+        }
+
+        void run()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            for (;;)
+            {
+                wake.wait(lock, [this] { return head.load(std::memory_order_relaxed) || stopping; });
+                deferred_policy::counts* const list = head.exchange(nullptr, std::memory_order_acquire);
+                if (!list)
+                {
+                    if (stopping)
+                    {
+                        return;
+                    }
+                    continue;
+                }
+                busy = true;
+                lock.unlock();
+                finish(list);
+                lock.lock();
+                busy = false;
+                if (!head.load(std::memory_order_relaxed))
+                {
+                    idle.notify_all();
+                }
+            }
+        }
+
+        static inline std::atomic<deferred_policy::counts*> head{nullptr};
+        static inline std::atomic<bool> stopped{false};
+
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::condition_variable idle;
+        bool busy = false;
+        bool stopping = false;
+        std::thread worker;
+    };
+}
+
+inline detail::released deferred_policy::counts::release_strong() noexcept
+{
+    detail::released const result = shared.release_strong();
+    if (result != detail::released::none)
+    {
+        detail::reclaimer::push(detail::control_block<deferred_policy>::of(this), result);
+    }
+    return detail::released::none;
+}
+
+inline void deferred_policy::drain()
+{
+    detail::reclaimer::instance().drain();
+}
+
+// Scope in which the calling thread's shared_ptr<T, batched_policy>
+// destructors, and with them reset() and assignment, record the reference
+// they drop instead of dropping it. The scope drops the recorded
+// references when it ends, with one atomic operation per control block, so
+// releasing thousands of pointers to a few shared objects costs a few
+// RMWs. Objects whose last reference was recorded are destroyed then too,
+// and use_count() still includes recorded references until then. Blocks
+// that don't fit in the table are released right away. Scopes nest; the
+// innermost one records.
+class release_batch
+{
+public:
+    using block = detail::control_block<batched_policy>;
+
+    release_batch() noexcept
+        : outer(std::exchange(active, this))
+    {}
+
+    release_batch(release_batch const&) = delete;
+    release_batch& operator=(release_batch const&) = delete;
+
+    ~release_batch()
+    {
+        flush();
+        active = outer;
+    }
+
+    // The calling thread's innermost scope, null outside of any.
+    static release_batch* current() noexcept
+    {
+        return active;
+    }
+
+    // Takes over one strong reference on cb.
+    void add(block* cb) noexcept
+    {
+        std::size_t const home = (reinterpret_cast<std::uintptr_t>(cb) / alignof(block)) % slot_count;
+        for (std::size_t probe = 0; probe != max_probes; ++probe)
+        {
+            entry& e = entries[(home + probe) % slot_count];
+            if (e.cb == cb && e.count != max_count)
+            {
+                ++e.count;
+                return;
+            }
+            if (!e.cb)
+            {
+                e = {cb, 1};
+                ++used;
+                return;
+            }
+        }
+        cb->release_strong();
+    }
+
+    // Drops the references recorded so far, including the ones destructors
+    // record meanwhile.
+    void flush() noexcept
+    {
+        while (used != 0)
+        {
+            for (entry& e : entries)
+            {
+                if (e.cb)
+                {
+                    entry const taken = std::exchange(e, entry());
+                    --used;
+                    taken.cb->release_strong(taken.count);
+                }
+            }
+        }
+    }
+
+private:
+    struct entry
+    {
+        block* cb = nullptr;
+        std::uint32_t count = 0;
+    };
+
+    static constexpr std::size_t slot_count = 64;
+    static constexpr std::size_t max_probes = 4;
+    static constexpr std::uint32_t max_count = std::uint32_t(1) << 30;
+
+    static inline thread_local release_batch* active = nullptr;
+
+    release_batch* const outer;
+    std::size_t used = 0;
+    entry entries[slot_count];
+};
+
+template <typename T, typename Policy>
+class shared_ptr
+{
+public:
+    using element_type = std::remove_extent_t<T>;
+
+    shared_ptr() noexcept = default;
+
+    shared_ptr(std::nullptr_t) noexcept
+    {}
+
+    // For shared_ptr<T[]> and shared_ptr<T[N]> the pointer is released with delete[].
+    template <typename Y, typename = std::enable_if_t<detail::accepts_pointer_v<Y, T>>>
+    explicit shared_ptr(Y* ptr)
+        : shared_ptr(ptr, std::default_delete<std::conditional_t<std::is_array_v<T>, Y[], Y>>())
+    {}
+
+    template <typename Y, typename D, typename = std::enable_if_t<detail::accepts_pointer_v<Y, T>>>
+    shared_ptr(Y* ptr, D deleter)
+        : shared_ptr(ptr, std::move(deleter), detail::default_block_allocator<Y>())
+    {}
+
+    // The control block is allocated through a copy of allocator.
+    template <typename Y, typename D, typename A, typename = std::enable_if_t<detail::accepts_pointer_v<Y, T>>>
+    shared_ptr(Y* ptr, D deleter, A allocator)
+        : ptr(ptr)
+    {
+        try
+        {
+            cb = detail::allocate_block<detail::ptr_block<Y, D, A, Policy>>(allocator, ptr, deleter, allocator);
+        }
+        catch (...)
+        {
+            deleter(ptr);
+            throw;
+        }
+    }
+
+    // Aliasing constructor: shares ownership with other, but points to ptr.
+    template <typename Y>
+    shared_ptr(shared_ptr<Y, Policy> const& other, element_type* ptr) noexcept
+        : ptr(ptr)
+        , cb(other.cb)
+    {
+        if (cb)
+        {
+            cb->add_strong();
+        }
+    }
+
+    shared_ptr(shared_ptr const& other) noexcept
+        : ptr(other.ptr)
+        , cb(other.cb)
+    {
+        if (cb)
+        {
+            cb->add_strong();
+        }
+    }
+
+    template <typename Y, typename = std::enable_if_t<detail::is_compatible_v<Y, T>>>
+    shared_ptr(shared_ptr<Y, Policy> const& other) noexcept
+        : ptr(other.ptr)
+        , cb(other.cb)
+    {
+        if (cb)
+        {
+            cb->add_strong();
+        }
+    }
+
+    shared_ptr(shared_ptr&& other) noexcept
+        : ptr(std::exchange(other.ptr, nullptr))
+        , cb(std::exchange(other.cb, nullptr))
+    {}
+
+    template <typename Y, typename = std::enable_if_t<detail::is_compatible_v<Y, T>>>
+    shared_ptr(shared_ptr<Y, Policy>&& other) noexcept
+        : ptr(std::exchange(other.ptr, nullptr))
+        , cb(std::exchange(other.cb, nullptr))
+    {}
+
+    // Converting a thin_shared_ptr that does not alias leaves the
+    // reference count alone when moving.
+    template <typename Y, typename = std::enable_if_t<detail::is_compatible_v<Y, T> &&
+                                                      std::is_same_v<Policy, detail::default_policy>>>
+    shared_ptr(thin_shared_ptr<Y> const& other) noexcept
+        : ptr(other.get())
+        , cb(detail::owner_of(other.cb))
+    {
+        if (cb)
+        {
+            cb->add_strong();
+        }
+    }
+
+    template <typename Y, typename = std::enable_if_t<detail::is_compatible_v<Y, T> &&
+                                                      std::is_same_v<Policy, detail::default_policy>>>
+    shared_ptr(thin_shared_ptr<Y>&& other) noexcept
+        : ptr(other.get())
+        , cb(detail::unwrap_alias(std::exchange(other.cb, nullptr)))
+    {}
+
+    ~shared_ptr()
+    {
+        if (cb)
+        {
+            if constexpr (std::is_same_v<Policy, batched_policy>)
+            {
+                if (release_batch* batch = release_batch::current())
+                {
+                    batch->add(cb);
+                    return;
+                }
+            }
+            detail::release_as<T, Policy>()(cb);
+        }
+    }
+
+    shared_ptr& operator=(shared_ptr const& other) noexcept
+    {
+        shared_ptr(other).swap(*this);
+        return *this;
+    }
+
+    template <typename Y>
+    shared_ptr& operator=(shared_ptr<Y, Policy> const& other) noexcept
+    {
+        shared_ptr(other).swap(*this);
+        return *this;
+    }
+
+    shared_ptr& operator=(shared_ptr&& other) noexcept
+    {
+        shared_ptr(std::move(other)).swap(*this);
+        return *this;
+    }
+
+    template <typename Y>
+    shared_ptr& operator=(shared_ptr<Y, Policy>&& other) noexcept
+    {
+        shared_ptr(std::move(other)).swap(*this);
+        return *this;
+    }
+
+    void reset() noexcept
+    {
+        shared_ptr().swap(*this);
+    }
+
+    template <typename Y>
+    void reset(Y* ptr)
+    {
+        shared_ptr(ptr).swap(*this);
+    }
+
+    template <typename Y, typename D>
+    void reset(Y* ptr, D deleter)
+    {
+        shared_ptr(ptr, std::move(deleter)).swap(*this);
+    }
+
+    template <typename Y, typename D, typename A>
+    void reset(Y* ptr, D deleter, A allocator)
+    {
+        shared_ptr(ptr, std::move(deleter), std::move(allocator)).swap(*this);
+    }
+
+    void swap(shared_ptr& other) noexcept
+    {
+        std::swap(ptr, other.ptr);
+        std::swap(cb, other.cb);
+    }
+
+    element_type* get() const noexcept
+    {
+        return ptr;
+    }
+
+    std::add_lvalue_reference_t<element_type> operator*() const noexcept
+    {
+        return *ptr;
+    }
+
+    element_type* operator->() const noexcept
+    {
+        return ptr;
+    }
+
+    template <typename U = T, typename = std::enable_if_t<std::is_array_v<U>>>
+    element_type& operator[](std::ptrdiff_t i) const noexcept
+    {
+        return ptr[i];
+    }
+
+    long use_count() const noexcept
+    {
+        return cb ? cb->use_count() : 0;
+    }
+
+    explicit operator bool() const noexcept
+    {
+        return ptr != nullptr;
+    }
+
+private:
+    shared_ptr(detail::adopt_ref_t, element_type* ptr, detail::control_block<Policy>* cb) noexcept
+        : ptr(ptr)
+        , cb(cb)
+    {}
+
+    template <typename Y, typename P>
+    friend class shared_ptr;
+
+    template <typename Y, typename P>
+    friend class weak_ptr;
+
+    template <typename Y>
+    friend class thin_shared_ptr;
+
+    template <typename Y, typename R>
+    friend class atomic_shared_ptr;
+
+    friend struct detail::ptr_access;
+
+    element_type* ptr = nullptr;
+    detail::control_block<Policy>* cb = nullptr;
+};
+
+template <typename T, typename Policy>
+class weak_ptr
+{
+public:
+    using element_type = std::remove_extent_t<T>;
+
+    weak_ptr() noexcept = default;
+
+    template <typename Y, typename = std::enable_if_t<detail::is_compatible_v<Y, T>>>
+    weak_ptr(shared_ptr<Y, Policy> const& other) noexcept
+        : ptr(other.ptr)
+        , cb(other.cb)
+    {
+        if (cb)
+        {
+            cb->add_weak();
+        }
+    }
+
+    template <typename Y, typename = std::enable_if_t<detail::is_compatible_v<Y, T> &&
+                                                      std::is_same_v<Policy, detail::default_policy>>>
+    weak_ptr(thin_shared_ptr<Y> const& other) noexcept
+        : ptr(other.get())
+        , cb(detail::owner_of(other.cb))
+    {
+        if (cb)
+        {
+            cb->add_weak();
+        }
+    }
+
+    weak_ptr(weak_ptr const& other) noexcept
+        : ptr(other.ptr)
+        , cb(other.cb)
+    {
+        if (cb)
+        {
+            cb->add_weak();
+        }
+    }
+
+    template <typename Y, typename = std::enable_if_t<detail::is_compatible_v<Y, T>>>
+    weak_ptr(weak_ptr<Y, Policy> const& other) noexcept
+        : ptr(other.ptr)
+        , cb(other.cb)
+    {
+        if (cb)
+        {
+            cb->add_weak();
+        }
+    }
+
+    weak_ptr(weak_ptr&& other) noexcept
+        : ptr(std::exchange(other.ptr, nullptr))
+        , cb(std::exchange(other.cb, nullptr))
+    {}
+
+    template <typename Y, typename = std::enable_if_t<detail::is_compatible_v<Y, T>>>
+    weak_ptr(weak_ptr<Y, Policy>&& other) noexcept
+        : ptr(std::exchange(other.ptr, nullptr))
+        , cb(std::exchange(other.cb, nullptr))
+    {}
+
+    ~weak_ptr()
+    {
+        if (cb)
+        {
+            cb->release_weak();
+        }
+    }
+
+    weak_ptr& operator=(weak_ptr const& other) noexcept
+    {
+        weak_ptr(other).swap(*this);
+        return *this;
+    }
+
+    template <typename Y>
+    weak_ptr& operator=(weak_ptr<Y, Policy> const& other) noexcept
+    {
+        weak_ptr(other).swap(*this);
+        return *this;
+    }
+
+    template <typename Y>
+    weak_ptr& operator=(shared_ptr<Y, Policy> const& other) noexcept
+    {
+        weak_ptr(other).swap(*this);
+        return *this;
+    }
+
+    weak_ptr& operator=(weak_ptr&& other) noexcept
+    {
+        weak_ptr(std::move(other)).swap(*this);
+        return *this;
+    }
+
+    template <typename Y>
+    weak_ptr& operator=(weak_ptr<Y, Policy>&& other) noexcept
+    {
+        weak_ptr(std::move(other)).swap(*this);
+        return *this;
+    }
+
+    void reset() noexcept
+    {
+        weak_ptr().swap(*this);
+    }
+
+    void swap(weak_ptr& other) noexcept
+    {
+        std::swap(ptr, other.ptr);
+        std::swap(cb, other.cb);
+    }
+
+    long use_count() const noexcept
+    {
+        return cb ? cb->use_count() : 0;
+    }
+
+    bool expired() const noexcept
+    {
+        return use_count() == 0;
+    }
+
+    // Lock-free: the strong count is only ever incremented from a non-zero
+    // value, so an object whose last shared_ptr is gone never comes back.
+    // Locking an expired pointer fails after one load, without writing to
+    // the block other threads may still be reading.
+    shared_ptr<T, Policy> lock() const noexcept
+    {
+        if (cb && cb->try_add_strong())
+        {
+            return shared_ptr<T, Policy>(detail::adopt_ref_t(), ptr, cb);
+        }
+        return shared_ptr<T, Policy>();
+    }
+
+private:
+    template <typename Y, typename P>
+    friend class weak_ptr;
+
+    template <typename Y>
+    friend class atomic_weak_ptr;
+
+    element_type* ptr = nullptr;
+    detail::control_block<Policy>* cb = nullptr;
+};
+
+// Shared pointer one word wide. It keeps only the control block, which
+// knows the address of its object; a pointer that differs from it (after
+// aliasing, or a conversion to a base at an offset) gets a small alias
+// block of its own. Conversions from and to shared_ptr don't touch the
+// reference count when moving, unless an alias block is involved.
+template <typename T>
+class thin_shared_ptr
+{
+public:
+    using element_type = T;
+
+    thin_shared_ptr() noexcept = default;
+
+    thin_shared_ptr(std::nullptr_t) noexcept
+    {}
+
+    template <typename Y, typename = std::enable_if_t<std::is_convertible_v<Y*, T*>>>
+    thin_shared_ptr(shared_ptr<Y> const& other)
+        : thin_shared_ptr(shared_ptr<Y>(other))
+    {}
+
+    template <typename Y, typename = std::enable_if_t<std::is_convertible_v<Y*, T*>>>
+    thin_shared_ptr(shared_ptr<Y>&& other)
+        : cb(detail::make_thin(detail::to_void(static_cast<T*>(other.ptr)),
+                               std::exchange(other.cb, nullptr)))
+    {
+        other.ptr = nullptr;
+    }
+
+    thin_shared_ptr(thin_shared_ptr const& other) noexcept
+        : cb(other.cb)
+    {
+        if (cb)
+        {
+            cb->add_strong();
+        }
+    }
+
+    template <typename Y, typename = std::enable_if_t<std::is_convertible_v<Y*, T*>>>
+    thin_shared_ptr(thin_shared_ptr<Y> const& other)
+        : thin_shared_ptr(thin_shared_ptr<Y>(other))
+    {}
+
+    thin_shared_ptr(thin_shared_ptr&& other) noexcept
+        : cb(std::exchange(other.cb, nullptr))
+    {}
+
+    template <typename Y, typename = std::enable_if_t<std::is_convertible_v<Y*, T*>>>
+    thin_shared_ptr(thin_shared_ptr<Y>&& other)
+    {
+        T* ptr = other.get();
+        cb = detail::make_thin(detail::to_void(ptr), std::exchange(other.cb, nullptr));
+    }
+
+    ~thin_shared_ptr()
+    {
+        if (cb)
+        {
+            detail::release_as<T, detail::default_policy>()(cb);
+        }
+    }
+
+    thin_shared_ptr& operator=(thin_shared_ptr const& other) noexcept
+    {
+        thin_shared_ptr(other).swap(*this);
+        return *this;
+    }
+
+    thin_shared_ptr& operator=(thin_shared_ptr&& other) noexcept
+    {
+        thin_shared_ptr(std::move(other)).swap(*this);
+        return *this;
+    }
+
+    void reset() noexcept
+    {
+        thin_shared_ptr().swap(*this);
+    }
+
+    void swap(thin_shared_ptr& other) noexcept
+    {
+        std::swap(cb, other.cb);
+    }
+
+    T* get() const noexcept
+    {
+        return cb ? static_cast<T*>(cb->pointer()) : nullptr;
+    }
+
+    std::add_lvalue_reference_t<T> operator*() const noexcept
+    {
+        return *get();
+    }
+
+    T* operator->() const noexcept
+    {
+        return get();
+    }
+
+    long use_count() const noexcept
+    {
+        return cb ? cb->use_count() : 0;
+    }
+
+    explicit operator bool() const noexcept
+    {
+        return get() != nullptr;
+    }
+
+private:
+    template <typename Y, typename P>
+    friend class shared_ptr;
+
+    template <typename Y, typename P>
+    friend class weak_ptr;
+
+    template <typename Y>
+    friend class thin_shared_ptr;
+
+    detail::thin_block* cb = nullptr;
+};
+
+namespace detail
+{
+    struct ptr_access
+    {
+        template <typename T, typename Policy>
+        static shared_ptr<T, Policy> adopt(typename shared_ptr<T, Policy>::element_type* ptr,
+                                           control_block<Policy>* cb) noexcept
+        {
+            return shared_ptr<T, Policy>(adopt_ref_t(), ptr, cb);
+        }
+
+        // Takes p's reference, leaving it empty.
+        template <typename T, typename Policy>
+        static control_block<Policy>* release(shared_ptr<T, Policy>& p) noexcept
+        {
+            p.ptr = nullptr;
+            return std::exchange(p.cb, nullptr);
+        }
+
+        template <typename T, typename Policy>
+        static control_block<Policy>* block(shared_ptr<T, Policy> const& p) noexcept
+        {
+            return p.cb;
+        }
+    };
+
+    template <typename T, typename Policy, typename A, typename... Init>
+    shared_ptr<T, Policy> allocate_shared_array(A const& allocator, std::size_t count, Init const&... init)
+    {
+        using block = inplace_array_block<std::remove_extent_t<T>, A, Policy>;
+        block* cb = block::create(allocator, count, init...);
+        return ptr_access::adopt<T, Policy>(cb->get(), cb);
+    }
+
+    template <typename T>
+    using default_allocator = std::allocator<std::remove_cv_t<std::remove_extent_t<T>>>;
+}
+
+template <typename T>
+void sharded_policy::collapse(shared_ptr<T, sharded_policy> const& p) noexcept
+{
+    if (detail::control_block<sharded_policy>* cb = detail::ptr_access::block(p))
+    {
+        cb->policy_counts().collapse();
+    }
+}
+
+namespace detail
+{
+    [[noreturn]] inline void borrow_outlived_object() noexcept
+    {
+        std::fputs("borrowed_ptr used after the object it borrows was disposed\n", stderr);
+        std::abort();
+    }
+}
+
+// Non-owning view of a shared_ptr, for passing an object down a call
+// chain without an increment and decrement per hop. share() takes a
+// reference for a callee that keeps the object. Whoever the borrow comes
+// from must own the object for as long as the borrow is used.
+//
+// Define SHARED_PTR_CHECK_BORROWS to have every borrow hold a weak
+// reference, and abort if it is dereferenced, shared or destroyed after
+// the object is gone. Without it, a borrowed_ptr is two trivially
+// copyable words.
+template <typename T, typename Policy = detail::default_policy>
+class borrowed_ptr
+{
+public:
+    using element_type = std::remove_extent_t<T>;
+
+    borrowed_ptr() noexcept = default;
+
+    borrowed_ptr(std::nullptr_t) noexcept
+    {}
+
+    template <typename Y, typename = std::enable_if_t<detail::is_compatible_v<Y, T>>>
+    borrowed_ptr(shared_ptr<Y, Policy> const& source) noexcept
+        : ptr(source.get())
+        , cb(detail::ptr_access::block(source))
+    {
+        watch();
+    }
+
+    template <typename Y, typename = std::enable_if_t<detail::is_compatible_v<Y, T>>>
+    borrowed_ptr(borrowed_ptr<Y, Policy> const& other) noexcept
+        : ptr(other.ptr)
+        , cb(other.cb)
+    {
+        watch();
+    }
+
+#ifdef SHARED_PTR_CHECK_BORROWS
+    borrowed_ptr(borrowed_ptr const& other) noexcept
+        : ptr(other.ptr)
+        , cb(other.cb)
+    {
+        watch();
+    }
+
+    ~borrowed_ptr()
+    {
+        unwatch();
+    }
+
+    borrowed_ptr& operator=(borrowed_ptr const& other) noexcept
+    {
+        if (this != &other)
+        {
+            unwatch();
+            ptr = other.ptr;
+            cb = other.cb;
+            watch();
+        }
+        return *this;
+    }
+#endif
+
+    element_type* get() const noexcept
+    {
+        check();
+        return ptr;
+    }
+
+    std::add_lvalue_reference_t<element_type> operator*() const noexcept
+    {
+        return *get();
+    }
+
+    element_type* operator->() const noexcept
+    {
+        return get();
+    }
+
+    explicit operator bool() const noexcept
+    {
+        return ptr != nullptr;
+    }
+
+    // A shared_ptr owning the object, at the cost of one increment.
+    shared_ptr<T, Policy> share() const noexcept
+    {
+        if (cb)
+        {
+            check();
+            cb->add_strong();
+        }
+        return detail::ptr_access::adopt<T, Policy>(ptr, cb);
+    }
+
+private:
+    template <typename Y, typename P>
+    friend class borrowed_ptr;
+
+    void check() const noexcept
+    {
+#ifdef SHARED_PTR_CHECK_BORROWS
+        if (cb && cb->use_count() == 0)
+        {
+            detail::borrow_outlived_object();
+        }
+#endif
+    }
+
+    void watch() const noexcept
+    {
+#ifdef SHARED_PTR_CHECK_BORROWS
+        if (cb)
+        {
+            check();
+            cb->add_weak();
+        }
+#endif
+    }
+
+    void unwatch() const noexcept
+    {
+#ifdef SHARED_PTR_CHECK_BORROWS
+        if (cb)
+        {
+            check();
+            cb->release_weak();
+        }
+#endif
+    }
+
+    element_type* ptr = nullptr;
+    detail::control_block<Policy>* cb = nullptr;
+};
+
+// Allocates the control block and the object together through a copy of
+// allocator rebound to the block type. Every factory takes the counting
+// policy as its second template argument: for a local_shared_ptr<T>, call
+// make_shared<T, single_thread_policy>().
+template <typename T, typename Policy = detail::default_policy, typename A, typename... Args>
+std::enable_if_t<!std::is_array_v<T>, shared_ptr<T, Policy>> allocate_shared(A const& allocator, Args&&... args)
+{
+    using block = detail::inplace_block<T, A, Policy>;
+    block* cb = detail::allocate_block<block>(allocator, allocator, std::forward<Args>(args)...);
+    return detail::ptr_access::adopt<T, Policy>(cb->get(), cb);
+}
+
+template <typename T, typename Policy = detail::default_policy, typename A, typename... Args>
+std::enable_if_t<!std::is_array_v<T>, shared_ptr<T, Policy>>
+allocate_shared(A const& allocator, cache_line_isolated_t, Args&&... args)
+{
+    using block = detail::inplace_block<T, A, Policy, cache_line_isolated_t>;
+    block* cb = detail::allocate_block<block>(allocator, allocator, std::forward<Args>(args)...);
+    return detail::ptr_access::adopt<T, Policy>(cb->get(), cb);
+}
+
+// One allocation holds the control block and count value-initialized elements.
+template <typename T, typename Policy = detail::default_policy, typename A>
+std::enable_if_t<detail::is_unbounded_array_v<T>, shared_ptr<T, Policy>>
+allocate_shared(A const& allocator, std::size_t count)
+{
+    return detail::allocate_shared_array<T, Policy>(allocator, count);
+}
+
+template <typename T, typename Policy = detail::default_policy, typename A>
+std::enable_if_t<detail::is_unbounded_array_v<T>, shared_ptr<T, Policy>>
+allocate_shared(A const& allocator, std::size_t count, std::remove_extent_t<T> const& init)
+{
+    return detail::allocate_shared_array<T, Policy>(allocator, count, init);
+}
+
+template <typename T, typename Policy = detail::default_policy, typename A>
+std::enable_if_t<detail::is_bounded_array_v<T>, shared_ptr<T, Policy>> allocate_shared(A const& allocator)
+{
+    return detail::allocate_shared_array<T, Policy>(allocator, std::extent_v<T>);
+}
+
+template <typename T, typename Policy = detail::default_policy, typename A>
+std::enable_if_t<detail::is_bounded_array_v<T>, shared_ptr<T, Policy>>
+allocate_shared(A const& allocator, std::remove_extent_t<T> const& init)
+{
+    return detail::allocate_shared_array<T, Policy>(allocator, std::extent_v<T>, init);
+}
+
+template <typename T, typename Policy = detail::default_policy, typename... Args>
+std::enable_if_t<!std::is_array_v<T>, shared_ptr<T, Policy>> make_shared(Args&&... args)
+{
+    return ::allocate_shared<T, Policy>(detail::default_allocator<T>(), std::forward<Args>(args)...);
+}
+
+template <typename T, typename Policy = detail::default_policy, typename... Args>
+std::enable_if_t<!std::is_array_v<T>, shared_ptr<T, Policy>> make_shared(cache_line_isolated_t, Args&&... args)
+{
+    return ::allocate_shared<T, Policy>(detail::default_allocator<T>(), cache_line_isolated,
+                                        std::forward<Args>(args)...);
+}
+
+template <typename T, typename Policy = detail::default_policy>
+std::enable_if_t<detail::is_unbounded_array_v<T>, shared_ptr<T, Policy>> make_shared(std::size_t count)
+{
+    return ::allocate_shared<T, Policy>(detail::default_allocator<T>(), count);
+}
+
+template <typename T, typename Policy = detail::default_policy>
+std::enable_if_t<detail::is_unbounded_array_v<T>, shared_ptr<T, Policy>>
+make_shared(std::size_t count, std::remove_extent_t<T> const& init)
+{
+    return ::allocate_shared<T, Policy>(detail::default_allocator<T>(), count, init);
+}
+
+template <typename T, typename Policy = detail::default_policy>
+std::enable_if_t<detail::is_bounded_array_v<T>, shared_ptr<T, Policy>> make_shared()
+{
+    return ::allocate_shared<T, Policy>(detail::default_allocator<T>());
+}
+
+template <typename T, typename Policy = detail::default_policy>
+std::enable_if_t<detail::is_bounded_array_v<T>, shared_ptr<T, Policy>> make_shared(std::remove_extent_t<T> const& init)
+{
+    return ::allocate_shared<T, Policy>(detail::default_allocator<T>(), init);
+}
+
+template <typename T, typename U, typename P>
+bool operator==(shared_ptr<T, P> const& a, shared_ptr<U, P> const& b) noexcept
+{
+    return a.get() == b.get();
+}
+
+template <typename T, typename U, typename P>
+bool operator!=(shared_ptr<T, P> const& a, shared_ptr<U, P> const& b) noexcept
+{
+    return !(a == b);
+}
+
+template <typename T, typename P>
+bool operator==(shared_ptr<T, P> const& a, std::nullptr_t) noexcept
+{
+    return !a;
+}
+
+template <typename T, typename P>
+bool operator==(std::nullptr_t, shared_ptr<T, P> const& a) noexcept
+{
+    return !a;
+}
+
+template <typename T, typename P>
+bool operator!=(shared_ptr<T, P> const& a, std::nullptr_t) noexcept
+{
+    return static_cast<bool>(a);
+}
+
+template <typename T, typename P>
+bool operator!=(std::nullptr_t, shared_ptr<T, P> const& a) noexcept
+{
+    return static_cast<bool>(a);
+}
+
+template <typename T, typename U>
+bool operator==(thin_shared_ptr<T> const& a, thin_shared_ptr<U> const& b) noexcept
+{
+    return a.get() == b.get();
+}
+
+template <typename T, typename U>
+bool operator!=(thin_shared_ptr<T> const& a, thin_shared_ptr<U> const& b) noexcept
+{
+    return !(a == b);
+}
+
+template <typename T>
+bool operator==(thin_shared_ptr<T> const& a, std::nullptr_t) noexcept
+{
+    return !a;
+}
+
+template <typename T>
+bool operator==(std::nullptr_t, thin_shared_ptr<T> const& a) noexcept
+{
+    return !a;
+}
+
+template <typename T>
+bool operator!=(thin_shared_ptr<T> const& a, std::nullptr_t) noexcept
+{
+    return static_cast<bool>(a);
+}
+
+template <typename T>
+bool operator!=(std::nullptr_t, thin_shared_ptr<T> const& a) noexcept
+{
+    return static_cast<bool>(a);
+}
+
+// Like allocate_shared/make_shared, but objects are default-initialized:
+// buffers of trivial types are not zeroed, which saves touching every byte
+// of memory that is about to be overwritten anyway.
+template <typename T, typename Policy = detail::default_policy, typename A>
+std::enable_if_t<!std::is_array_v<T>, shared_ptr<T, Policy>> allocate_shared_for_overwrite(A const& allocator)
+{
+    using block = detail::inplace_block<T, A, Policy>;
+    block* cb = detail::allocate_block<block>(allocator, detail::default_init_t(), allocator);
+    return detail::ptr_access::adopt<T, Policy>(cb->get(), cb);
+}
+
+template <typename T, typename Policy = detail::default_policy, typename A>
+std::enable_if_t<detail::is_unbounded_array_v<T>, shared_ptr<T, Policy>>
+allocate_shared_for_overwrite(A const& allocator, std::size_t count)
+{
+    return detail::allocate_shared_array<T, Policy>(allocator, count, detail::default_init_t());
+}
+
+template <typename T, typename Policy = detail::default_policy, typename A>
+std::enable_if_t<detail::is_bounded_array_v<T>, shared_ptr<T, Policy>> allocate_shared_for_overwrite(A const& allocator)
+{
+    return detail::allocate_shared_array<T, Policy>(allocator, std::extent_v<T>, detail::default_init_t());
+}
+
+template <typename T, typename Policy = detail::default_policy>
+std::enable_if_t<!detail::is_unbounded_array_v<T>, shared_ptr<T, Policy>> make_shared_for_overwrite()
+{
+    return ::allocate_shared_for_overwrite<T, Policy>(detail::default_allocator<T>());
+}
+
+template <typename T, typename Policy = detail::default_policy>
+std::enable_if_t<detail::is_unbounded_array_v<T>, shared_ptr<T, Policy>> make_shared_for_overwrite(std::size_t count)
+{
+    return ::allocate_shared_for_overwrite<T, Policy>(detail::default_allocator<T>(), count);
+}
+
+// Lock-free std::atomic<shared_ptr<T>>, for values that many threads load
+// and few replace, like configuration published to request handlers. A
+// load is usually one fetch_add on the cell and never takes a lock, see
+// detail::split_ref_cell.
+//
+// Counts are always those of multi_thread_policy; pointers that differ from
+// the one their block owns are stored through an alias_block, as in
+// thin_shared_ptr. Loads are acquire and the other operations sequentially
+// consistent, whatever memory order is passed.
+//
+// With Reclaim = hazard_reclaim, the value can also be read through a
+// hazard_pointer, without a reference of its own.
+template <typename T, typename Reclaim>
+class atomic_shared_ptr
+{
+public:
+    using value_type = shared_ptr<T, multi_thread_policy>;
+
+    static constexpr bool is_always_lock_free = true;
+
+    constexpr atomic_shared_ptr() noexcept = default;
+
+    constexpr atomic_shared_ptr(std::nullptr_t) noexcept
+    {}
+
+    atomic_shared_ptr(value_type desired)
+        : cell(to_block(std::move(desired)))
+    {}
+
+    atomic_shared_ptr(atomic_shared_ptr const&) = delete;
+    atomic_shared_ptr& operator=(atomic_shared_ptr const&) = delete;
+
+    void operator=(value_type desired)
+    {
+        store(std::move(desired));
+    }
+
+    void operator=(std::nullptr_t) noexcept
+    {
+        store(nullptr);
+    }
+
+    operator value_type() const noexcept
+    {
+        return load();
+    }
+
+    bool is_lock_free() const noexcept
+    {
+        return true;
+    }
+
+    value_type load(std::memory_order = std::memory_order_seq_cst) const noexcept
+    {
+        return adopt(cell.take());
+    }
+
+    void store(value_type desired, std::memory_order = std::memory_order_seq_cst)
+    {
+        cell_type::drop(cell.exchange(to_block(std::move(desired))));
+    }
+
+    value_type exchange(value_type desired, std::memory_order = std::memory_order_seq_cst)
+    {
+        return adopt(cell.exchange(to_block(std::move(desired))));
+    }
+
+    bool compare_exchange_strong(value_type& expected, value_type desired, std::memory_order,
+                                 std::memory_order)
+    {
+        return compare_exchange_strong(expected, std::move(desired));
+    }
+
+    bool compare_exchange_strong(value_type& expected, value_type desired,
+                                 std::memory_order = std::memory_order_seq_cst)
+    {
+        block* const next = to_block(std::move(desired));
+        for (;;)
+        {
+            block* const current = cell.take();
+            if (!equivalent(current, expected))
+            {
+                cell_type::drop(next);
+                expected = adopt(current);
+                return false;
+            }
+            bool const stored = cell.compare_exchange(current, next);
+            cell_type::drop(current);
+            if (stored)
+            {
+                return true;
+            }
+        }
+    }
+
+    // Never fails spuriously.
+    bool compare_exchange_weak(value_type& expected, value_type desired, std::memory_order success,
+                               std::memory_order failure)
+    {
+        return compare_exchange_strong(expected, std::move(desired), success, failure);
+    }
+
+    bool compare_exchange_weak(value_type& expected, value_type desired,
+                               std::memory_order order = std::memory_order_seq_cst)
+    {
+        return compare_exchange_strong(expected, std::move(desired), order);
+    }
+
+private:
+    using cell_type = detail::split_ref_cell<detail::strong_refs, Reclaim>;
+    using block = typename cell_type::block;
+
+    friend class hazard_pointer;
+    friend class ebr_guard;
+
+    static block* to_block(value_type desired)
+    {
+        void* const ptr = detail::to_void(desired.get());
+        desired.ptr = nullptr;
+        return detail::make_thin(ptr, std::exchange(desired.cb, nullptr));
+    }
+
+    static value_type adopt(block* cb) noexcept
+    {
+        if (!cb)
+        {
+            return value_type();
+        }
+        auto* const ptr = static_cast<typename value_type::element_type*>(cb->pointer());
+        return detail::ptr_access::adopt<T, multi_thread_policy>(ptr, detail::unwrap_alias(cb));
+    }
+
+    // Same pointer and same owner, as std::atomic<shared_ptr> compares.
+    static bool equivalent(block* cb, value_type const& p) noexcept
+    {
+        if (!cb)
+        {
+            return !p.cb && !p.ptr;
+        }
+        return cb->pointer() == detail::to_void(p.ptr) && detail::owner_of(cb) == detail::owner_of(p.cb);
+    }
+
+    cell_type cell;
+};
+
+// std::atomic<weak_ptr<T>> on the same lock-free cell as atomic_shared_ptr,
+// for back references that threads keep replacing and locking. Pointers
+// that differ from the one their block owns are stored through a block
+// holding a weak reference on the owner.
+template <typename T>
+class atomic_weak_ptr
+{
+public:
+    using value_type = weak_ptr<T, multi_thread_policy>;
+
+    static constexpr bool is_always_lock_free = true;
+
+    constexpr atomic_weak_ptr() noexcept = default;
+
+    atomic_weak_ptr(value_type desired)
+        : cell(to_block(std::move(desired)))
+    {}
+
+    atomic_weak_ptr(atomic_weak_ptr const&) = delete;
+    atomic_weak_ptr& operator=(atomic_weak_ptr const&) = delete;
+
+    void operator=(value_type desired)
+    {
+        store(std::move(desired));
+    }
+
+    operator value_type() const noexcept
+    {
+        return load();
+    }
+
+    bool is_lock_free() const noexcept
+    {
+        return true;
+    }
+
+    value_type load(std::memory_order = std::memory_order_seq_cst) const noexcept
+    {
+        return adopt(cell.take());
+    }
+
+    void store(value_type desired, std::memory_order = std::memory_order_seq_cst)
+    {
+        cell_type::drop(cell.exchange(to_block(std::move(desired))));
+    }
+
+    value_type exchange(value_type desired, std::memory_order = std::memory_order_seq_cst)
+    {
+        return adopt(cell.exchange(to_block(std::move(desired))));
+    }
+
+    bool compare_exchange_strong(value_type& expected, value_type desired, std::memory_order,
+                                 std::memory_order)
+    {
+        return compare_exchange_strong(expected, std::move(desired));
+    }
+
+    bool compare_exchange_strong(value_type& expected, value_type desired,
+                                 std::memory_order = std::memory_order_seq_cst)
+    {
+        block* const next = to_block(std::move(desired));
+        for (;;)
+        {
+            block* const current = cell.take();
+            if (!equivalent(current, expected))
+            {
+                cell_type::drop(next);
+                expected = adopt(current);
+                return false;
+            }
+            bool const stored = cell.compare_exchange(current, next);
+            cell_type::drop(current);
+            if (stored)
+            {
+                return true;
+            }
+        }
+    }
+
+    // Never fails spuriously.
+    bool compare_exchange_weak(value_type& expected, value_type desired, std::memory_order success,
+                               std::memory_order failure)
+    {
+        return compare_exchange_strong(expected, std::move(desired), success, failure);
+    }
+
+    bool compare_exchange_weak(value_type& expected, value_type desired,
+                               std::memory_order order = std::memory_order_seq_cst)
+    {
+        return compare_exchange_strong(expected, std::move(desired), order);
+    }
+
+private:
+    using cell_type = detail::split_ref_cell<detail::weak_refs>;
+    using block = typename cell_type::block;
+
+    static block* to_block(value_type desired)
+    {
+        void* const ptr = detail::to_void(desired.ptr);
+        desired.ptr = nullptr;
+        return detail::make_weak_thin(ptr, std::exchange(desired.cb, nullptr));
+    }
+
+    static value_type adopt(block* cb) noexcept
+    {
+        value_type result;
+        if (cb)
+        {
+            result.ptr = static_cast<typename value_type::element_type*>(cb->pointer());
+            result.cb = detail::unwrap_weak_alias(cb);
+        }
+        return result;
+    }
+
+    static bool equivalent(block* cb, value_type const& p) noexcept
+    {
+        if (!cb)
+        {
+            return !p.cb && !p.ptr;
+        }
+        return cb->pointer() == detail::to_void(p.ptr) && detail::weak_owner_of(cb) == p.cb;
+    }
+
+    cell_type cell;
+};
+
+namespace detail
+{
+    // Per-thread records that readers announce themselves in, for writers
+    // to scan without locks. Threads take a record and give it back for
+    // another thread to reuse; records are freed only with the list.
+    // Record needs a std::atomic<bool> taken (initially true) and a next.
+    template <typename Record>
+    class record_list
+    {
+    public:
+        record_list() = default;
+
+        record_list(record_list const&) = delete;
+        record_list& operator=(record_list const&) = delete;
+
+        ~record_list()
+        {
+            Record* r = records.load(std::memory_order_relaxed);
+            while (r)
+            {
+                delete std::exchange(r, r->next);
+            }
+        }
+
+        Record* acquire()
+        {
+            for (Record* r = head(); r; r = r->next)
+            {
+                if (!r->taken.load(std::memory_order_relaxed) && !r->taken.exchange(true, std::memory_order_acquire))
+                {
+                    return r;
+                }
+            }
+            Record* r = new Record;
+            r->next = records.load(std::memory_order_relaxed);
+            while (!records.compare_exchange_weak(r->next, r, std::memory_order_release, std::memory_order_relaxed))
+            {}
+            count.fetch_add(1, std::memory_order_relaxed);
+            return r;
+        }
+
+        static void release(Record* r) noexcept
+        {
+            r->taken.store(false, std::memory_order_release);
+        }
+
+        Record* head() const noexcept
+        {
+            return records.load(std::memory_order_acquire);
+        }
+
+        std::size_t size() const noexcept
+        {
+            return count.load(std::memory_order_relaxed);
+        }
+
+    private:
+        std::atomic<Record*> records{nullptr};
+        std::atomic<std::size_t> count{0};
+    };
+}
+
+// Hazard pointers let readers use the value of an atomic_shared_ptr without
+// taking a reference: a reader announces the block it is about to use in
+// one of the domain's records, then checks that the cell still holds it.
+// Cells with Reclaim = hazard_reclaim hand the last reference they held on
+// a replaced value to retire(), which keeps it until no record announces
+// the block anymore.
+//
+// Records are never freed, only reused, so a scan walks every record a
+// thread ever took. Retired references are scanned once there are more of
+// them than twice the number of records, or on reclaim(). If there is no
+// memory to queue one, retire() waits for the hazard pointers of other
+// threads to leave it; if one of the calling thread's covers it, the
+// reference is leaked rather than wait forever.
+class hazard_domain
+{
+public:
+    hazard_domain() = default;
+
+    hazard_domain(hazard_domain const&) = delete;
+    hazard_domain& operator=(hazard_domain const&) = delete;
+
+    // No hazard_pointer of the domain may be left.
+    ~hazard_domain()
+    {
+        for (block* cb : retired)
+        {
+            cb->release_strong();
+        }
+    }
+
+    // The domain of hazard_pointer and hazard_reclaim.
+    static hazard_domain& global() noexcept
+    {
+        static hazard_domain domain;
+        return domain;
+    }
+
+    // Drops one strong reference on cb once no hazard pointer covers it.
+    void retire(detail::control_block<multi_thread_policy>* cb) noexcept
+    {
+        if (queue(cb) > 2 * records.size())
+        {
+            reclaim();
+        }
+    }
+
+    // Drops the retired references no hazard pointer covers anymore.
+    void reclaim() noexcept
+    {
+        std::vector<block*> candidates;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            candidates.swap(retired);
+        }
+        auto const covered_end = std::partition(candidates.begin(), candidates.end(),
+                                                [this](block* cb) { return covered(cb); });
+        // Releasing may destroy objects that retire blocks of their own, so
+        // it happens outside the lock.
+        for (auto i = covered_end; i != candidates.end(); ++i)
+        {
+            (*i)->release_strong();
+        }
+        candidates.erase(covered_end, candidates.end());
+        // Swapped back rather than inserted, so as not to allocate; what was
+        // retired meanwhile is queued again.
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            candidates.swap(retired);
+        }
+        for (block* cb : candidates)
+        {
+            queue(cb);
+        }
+    }
+
+private:
+    using block = detail::control_block<multi_thread_policy>;
+
+    struct record
+    {
+        std::atomic<block const*> hazard{nullptr};
+        std::atomic<bool> taken{true};
+        record* next = nullptr;
+        std::atomic<std::thread::id> owner{};
+    };
+
+    friend class hazard_pointer;
+
+    // Adds cb to the retired references and returns their number, or drops
+    // it here, and returns 0, if that fails.
+    std::size_t queue(block* cb) noexcept
+    {
+        try
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            retired.push_back(cb);
+            return retired.size();
+        }
+        catch (...)
+        {
+            drop_uncovered(cb);
+            return 0;
+        }
+    }
+
+    void drop_uncovered(block* cb) noexcept
+    {
+        std::thread::id const self = std::this_thread::get_id();
+        for (;;)
+        {
+            bool others = false;
+            for (record* r = records.head(); r; r = r->next)
+            {
+                if (r->hazard.load() == cb)
+                {
+                    if (r->owner.load(std::memory_order_relaxed) == self)
+                    {
+                        return;
+                    }
+                    others = true;
+                }
+            }
+            if (!others)
+            {
+                break;
+            }
+            std::this_thread::yield();
+        }
+        cb->release_strong();
+    }
+
+    // Sequentially consistent, like the announcement and the store that
+    // replaced cb: either the reader sees the new value and retries, or the
+    // announcement is seen here.
+    bool covered(block const* cb) const noexcept
+    {
+        for (record* r = records.head(); r; r = r->next)
+        {
+            if (r->hazard.load() == cb)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    detail::record_list<record> records;
+    std::mutex mutex;
+    std::vector<block*> retired;
+};
+
+// Reclaim policy of atomic_shared_ptr that retires replaced values through
+// hazard_domain::global().
+struct hazard_reclaim
+{
+    static void retire(detail::control_block<multi_thread_policy>* cb) noexcept
+    {
+        hazard_domain::global().retire(cb);
+    }
+};
+
+// A record of hazard_domain::global(), owned by one reader. Taking one is a
+// walk over the records, so a reader thread usually keeps it for its
+// lifetime and protects one value after another through it.
+class hazard_pointer
+{
+public:
+    hazard_pointer()
+        : entry(hazard_domain::global().records.acquire())
+    {
+        entry->owner.store(std::this_thread::get_id(), std::memory_order_relaxed);
+    }
+
+    hazard_pointer(hazard_pointer const&) = delete;
+    hazard_pointer& operator=(hazard_pointer const&) = delete;
+
+    ~hazard_pointer()
+    {
+        reset();
+        detail::record_list<hazard_domain::record>::release(entry);
+    }
+
+    // Returns the current value of cell, which stays alive until the next
+    // protect() or reset(), without touching its reference counts.
+    template <typename T>
+    typename atomic_shared_ptr<T, hazard_reclaim>::value_type::element_type*
+    protect(atomic_shared_ptr<T, hazard_reclaim> const& cell) noexcept
+    {
+        using element_type = typename atomic_shared_ptr<T, hazard_reclaim>::value_type::element_type;
+        detail::control_block<multi_thread_policy>* cb = cell.cell.peek();
+        for (;;)
+        {
+            entry->hazard.store(cb);
+            detail::control_block<multi_thread_policy>* const current = cell.cell.peek();
+            if (current == cb)
+            {
+                return cb ? static_cast<element_type*>(cb->pointer()) : nullptr;
+            }
+            cb = current;
+        }
+    }
+
+    void reset() noexcept
+    {
+        entry->hazard.store(nullptr, std::memory_order_release);
+    }
+
+private:
+    hazard_domain::record* const entry;
+};
+
+namespace detail
+{
+    // Read sections and grace periods behind rcu_cell. A thread in a read
+    // section announces, in its record, the epoch it entered at; outside of
+    // one the record holds 0. A value unpublished while the epoch was e may
+    // be released once no record holds a non-zero epoch up to e.
+    class rcu_domain
+    {
+    public:
+        struct record
+        {
+            std::atomic<std::uint64_t> entered{0};
+            std::atomic<bool> taken{true};
+            record* next = nullptr;
+            // Only touched by the owning thread.
+            unsigned nesting = 0;
+        };
+
+        static rcu_domain& global() noexcept
+        {
+            static rcu_domain domain;
+            return domain;
+        }
+
+        // The calling thread's record, taken at its first read section and
+        // given back when it exits.
+        static record* this_thread()
+        {
+            struct registration
+            {
+                registration()
+                    : r(global().records.acquire())
+                {}
+
+                ~registration()
+                {
+                    record_list<record>::release(r);
+                }
+
+                record* const r;
+            };
+            thread_local registration registered;
+            return registered.r;
+        }
+
+        // The epoch load pairs with advance(), so a reader that enters after
+        // a value was unpublished can only see its successor. The fence
+        // pairs with the one in passed(): either the writer sees the record
+        // or the reader sees the new value.
+        void enter(record* r) noexcept
+        {
+            if (r->nesting++ == 0)
+            {
+                r->entered.store(epoch.load(std::memory_order_acquire), std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+            }
+        }
+
+        void leave(record* r) noexcept
+        {
+            if (--r->nesting == 0)
+            {
+                r->entered.store(0, std::memory_order_release);
+            }
+        }
+
+        // Called after a value was unpublished; returns the epoch to retire
+        // it under.
+        std::uint64_t advance() noexcept
+        {
+            return epoch.fetch_add(1);
+        }
+
+        // Whether every read section that may have seen a value retired
+        // under tag has ended.
+        bool passed(std::uint64_t tag) const noexcept
+        {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            for (record* r = records.head(); r; r = r->next)
+            {
+                std::uint64_t const entered = r->entered.load(std::memory_order_acquire);
+                if (entered != 0 && entered <= tag)
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+    private:
+        std::atomic<std::uint64_t> epoch{1};
+        record_list<record> records;
+    };
+}
+
+// Read-side critical section of the calling thread for rcu_cell: values
+// read inside it stay alive until it ends. Sections nest. Entering is a
+// store to the thread's own record and a fence, leaving is a store; neither
+// writes to memory other threads write to.
+class rcu_read_guard
+{
+public:
+    rcu_read_guard()
+        : entry(detail::rcu_domain::this_thread())
+    {
+        detail::rcu_domain::global().enter(entry);
+    }
+
+    rcu_read_guard(rcu_read_guard const&) = delete;
+    rcu_read_guard& operator=(rcu_read_guard const&) = delete;
+
+    ~rcu_read_guard()
+    {
+        detail::rcu_domain::global().leave(entry);
+    }
+
+private:
+    detail::rcu_domain::record* const entry;
+};
+
+// Holder of a shared_ptr<T const> for values read on every request and
+// replaced once in a while, like configuration. Readers get a plain
+// pointer from read() inside an rcu_read_guard, with no atomic
+// read-modify-write. store() publishes a new value and holds on to the
+// old one until every read section that may still use it has ended, a
+// grace period. It releases values whose grace period is over without
+// waiting; synchronize() waits for the rest.
+template <typename T>
+class rcu_cell
+{
+public:
+    using value_type = shared_ptr<T const, multi_thread_policy>;
+
+    rcu_cell() noexcept = default;
+
+    explicit rcu_cell(value_type desired)
+        : current(to_block(std::move(desired)))
+    {}
+
+    rcu_cell(rcu_cell const&) = delete;
+    rcu_cell& operator=(rcu_cell const&) = delete;
+
+    // No reader may be left.
+    ~rcu_cell()
+    {
+        for (retired_value const& r : retired)
+        {
+            r.cb->release_strong();
+        }
+        if (block* const cb = current.load(std::memory_order_relaxed))
+        {
+            cb->release_strong();
+        }
+    }
+
+    // The current value, valid until guard ends.
+    T const* read(rcu_read_guard const&) const noexcept
+    {
+        block* const cb = current.load(std::memory_order_acquire);
+        return cb ? static_cast<T const*>(cb->pointer()) : nullptr;
+    }
+
+    // A reference to the current value, for use outside of read sections.
+    value_type load() const
+    {
+        rcu_read_guard guard;
+        block* const cb = current.load(std::memory_order_acquire);
+        if (!cb)
+        {
+            return value_type();
+        }
+        cb->add_strong();
+        return detail::ptr_access::adopt<T const, multi_thread_policy>(static_cast<T const*>(cb->pointer()),
+                                                                      detail::unwrap_alias(cb));
+    }
+
+    // Throws, with the cell unchanged, if there's no memory to retire the
+    // old value.
+    void store(value_type desired)
+    {
+        std::vector<block*> ready;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            retired.reserve(retired.size() + 1);
+            ready.reserve(retired.size() + 1);
+            block* const old = current.exchange(to_block(std::move(desired)));
+            if (old)
+            {
+                retired.push_back({old, detail::rcu_domain::global().advance()});
+            }
+            auto const waiting_end = std::partition(retired.begin(), retired.end(), [](retired_value const& r) {
+                return !detail::rcu_domain::global().passed(r.tag);
+            });
+            for (auto i = waiting_end; i != retired.end(); ++i)
+            {
+                ready.push_back(i->cb);
+            }
+            retired.erase(waiting_end, retired.end());
+        }
+        // Outside the lock: the destructors may use the cell.
+        for (block* cb : ready)
+        {
+            cb->release_strong();
+        }
+    }
+
+    // Waits for the grace period of every value replaced so far and
+    // releases them. Must not be called inside a read section.
+    void synchronize()
+    {
+        std::vector<retired_value> waiting;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            waiting.swap(retired);
+        }
+        for (retired_value const& r : waiting)
+        {
+            while (!detail::rcu_domain::global().passed(r.tag))
+            {
+                std::this_thread::yield();
+            }
+            r.cb->release_strong();
+        }
+    }
+
+private:
+    using block = detail::control_block<multi_thread_policy>;
+
+    struct retired_value
+    {
+        block* cb;
+        std::uint64_t tag;
+    };
+
+    static block* to_block(value_type desired)
+    {
+        void* const ptr = detail::to_void(desired.get());
+        return detail::make_thin(ptr, detail::ptr_access::release(desired));
+    }
+
+    std::atomic<block*> current{nullptr};
+    std::mutex mutex;
+    std::vector<retired_value> retired;
+};
+
+// Holder of a shared_ptr<T const> with a single writer, for small values
+// read at very high rates, like a market data snapshot. Besides the
+// shared_ptr, the cell keeps a copy of the value under a sequence counter.
+// read(f) copies it out without writing to shared memory and calls f on
+// the copy; a store() in progress makes it retry. load() copies the
+// shared_ptr itself, for readers that keep the value.
+//
+// T must be trivially copyable. Reads copy all of it, a word at a time
+// with relaxed atomics, so that a racing store() is not a data race; f
+// then picks the fields it needs. load() may briefly return the value
+// before the one read() sees while a store() is in progress.
+template <typename T>
+class seqlock_shared_cell
+{
+    static_assert(std::is_trivially_copyable_v<T>, "seqlock_shared_cell copies T as raw words");
+
+public:
+    using value_type = shared_ptr<T const, multi_thread_policy>;
+
+    // desired must not be null.
+    explicit seqlock_shared_cell(value_type desired)
+    {
+        store(std::move(desired));
+    }
+
+    seqlock_shared_cell(seqlock_shared_cell const&) = delete;
+    seqlock_shared_cell& operator=(seqlock_shared_cell const&) = delete;
+
+    // Calls f with a consistent copy of the current value and returns
+    // what f returns.
+    template <typename F>
+    decltype(auto) read(F&& f) const
+    {
+        alignas(T) unsigned char bytes[sizeof(T)];
+        for (;;)
+        {
+            std::uint64_t const before = sequence.load(std::memory_order_acquire);
+            if (before & 1)
+            {
+                continue;
+            }
+            word copy[word_count];
+            for (std::size_t i = 0; i != word_count; ++i)
+            {
+                copy[i] = words[i].load(std::memory_order_relaxed);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (sequence.load(std::memory_order_relaxed) == before)
+            {
+                std::memcpy(bytes, copy, sizeof(T));
+                return std::forward<F>(f)(*std::launder(reinterpret_cast<T const*>(bytes)));
+            }
+        }
+    }
+
+    value_type load() const
+    {
+        return current.load();
+    }
+
+    // Only one thread may store at a time. desired must not be null.
+    void store(value_type desired)
+    {
+        word copy[word_count] = {};
+        std::memcpy(copy, desired.get(), sizeof(T));
+        std::uint64_t const s = sequence.load(std::memory_order_relaxed);
+        sequence.store(s + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (std::size_t i = 0; i != word_count; ++i)
+        {
+            words[i].store(copy[i], std::memory_order_relaxed);
+        }
+        sequence.store(s + 2, std::memory_order_release);
+        current.store(std::move(desired));
+    }
+
+private:
+    using word = std::uint64_t;
+
+    static constexpr std::size_t word_count = (sizeof(T) + sizeof(word) - 1) / sizeof(word);
+
+    // Odd while a store() is writing the words.
+    std::atomic<std::uint64_t> sequence{0};
+    std::atomic<word> words[word_count];
+    atomic_shared_ptr<T const> current;
+};
+
+// Epoch-based reclamation for atomic_shared_ptr values read without a
+// reference. Readers pin the global epoch with an ebr_guard for any number
+// of reads. A cell with Reclaim = ebr_reclaim hands the reference it held
+// on a replaced value to retire(), which queues it on the calling thread
+// under the current epoch. The epoch only advances once every pinned
+// thread has pinned it, so once it has moved two past a value's epoch, no
+// reader can still use the value and its reference is dropped.
+//
+// Unlike hazard_domain, readers announce themselves once per guard rather
+// than once per value, and retire() only touches the calling thread's
+// queue; the records are scanned once every scan_every retires, or on the
+// first retire scan_period after the last scan, so that a thread retiring
+// slowly doesn't keep its values for long. The queues of exited threads
+// are left to reclaim(). If there is no memory to queue
+// a value, retire() waits for its grace period instead; inside a guard of
+// the calling thread that would never end, so the reference is leaked.
+class ebr_domain
+{
+public:
+    ebr_domain(ebr_domain const&) = delete;
+    ebr_domain& operator=(ebr_domain const&) = delete;
+
+    // No guard may be left.
+    ~ebr_domain()
+    {
+        for (retired_value const& r : orphans)
+        {
+            r.cb->release_strong();
+        }
+    }
+
+    // The domain of ebr_guard and ebr_reclaim.
+    static ebr_domain& global() noexcept
+    {
+        static ebr_domain domain;
+        return domain;
+    }
+
+    // Drops one strong reference on cb once every guard that may have
+    // read it has ended.
+    void retire(detail::control_block<multi_thread_policy>* cb) noexcept
+    {
+        participant* self = nullptr;
+        try
+        {
+            self = &this_thread();
+            self->limbo.push_back({cb, epoch.load()});
+        }
+        catch (...)
+        {
+            drop_after_grace(cb, self);
+            return;
+        }
+        auto const now = std::chrono::steady_clock::now();
+        if (++self->retires % scan_every == 0 || now - self->last_scan >= scan_period)
+        {
+            self->last_scan = now;
+            try_advance();
+            try_advance();
+            release(take_ready(self->limbo));
+        }
+    }
+
+    // Advances the epoch as far as the pinned threads allow, and drops the
+    // references queued by the calling thread and by exited threads whose
+    // readers are gone.
+    void reclaim() noexcept
+    {
+        try_advance();
+        try_advance();
+        try
+        {
+            release(take_ready(this_thread().limbo));
+        }
+        catch (...)
+        {
+            // No queue to drain.
+        }
+        std::vector<retired_value> ready;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ready = take_ready(orphans);
+        }
+        release(ready);
+    }
+
+private:
+    using block = detail::control_block<multi_thread_policy>;
+
+    struct record
+    {
+        // The epoch the thread pinned, 0 outside of a guard.
+        std::atomic<std::uint64_t> pinned{0};
+        std::atomic<bool> taken{true};
+        record* next = nullptr;
+        // Only touched by the owning thread.
+        unsigned nesting = 0;
+    };
+
+    struct retired_value
+    {
+        block* cb;
+        std::uint64_t epoch;
+    };
+
+    // The calling thread's record and queue. The record is given back when
+    // the thread exits, and the queue handed to reclaim().
+    struct participant
+    {
+        participant()
+            : r(global().records.acquire())
+        {}
+
+        ~participant()
+        {
+            detail::record_list<record>::release(r);
+            if (limbo.empty())
+            {
+                return;
+            }
+            ebr_domain& domain = global();
+            try
+            {
+                std::lock_guard<std::mutex> lock(domain.mutex);
+                domain.orphans.insert(domain.orphans.end(), limbo.begin(), limbo.end());
+                return;
+            }
+            catch (...)
+            {
+                // No memory to hand them over: wait for them here.
+            }
+            for (retired_value const& v : limbo)
+            {
+                domain.drop_after_grace(v.cb, nullptr);
+            }
+        }
+
+        record* const r;
+        std::vector<retired_value> limbo;
+        std::size_t retires = 0;
+        std::chrono::steady_clock::time_point last_scan;
+    };
+
+    friend class ebr_guard;
+
+    static constexpr std::size_t scan_every = 64;
+    static constexpr std::chrono::milliseconds scan_period{1};
+
+    ebr_domain() = default;
+
+    static participant& this_thread()
+    {
+        thread_local participant self;
+        return self;
+    }
+
+    // The fence orders the pin before the reads of the guard, against the
+    // one in try_advance(): either the scan sees the pin, or the reads see
+    // every value unpublished before the scan.
+    void pin(record* r) noexcept
+    {
+        if (r->nesting++ == 0)
+        {
+            r->pinned.store(epoch.load(), std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+    }
+
+    void unpin(record* r) noexcept
+    {
+        if (--r->nesting == 0)
+        {
+            r->pinned.store(0, std::memory_order_release);
+        }
+    }
+
+    // Moves the epoch on if every pinned thread has pinned the current one.
+    void try_advance() noexcept
+    {
+        std::uint64_t current = epoch.load();
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        for (record* r = records.head(); r; r = r->next)
+        {
+            std::uint64_t const pinned = r->pinned.load(std::memory_order_acquire);
+            if (pinned != 0 && pinned != current)
+            {
+                return;
+            }
+        }
+        epoch.compare_exchange_strong(current, current + 1);
+    }
+
+    // Moves the values queued two epochs ago or earlier out of values.
+    // Without memory to move them to, they stay queued.
+    std::vector<retired_value> take_ready(std::vector<retired_value>& values) noexcept
+    {
+        std::uint64_t const now = epoch.load();
+        auto const waiting_end = std::partition(values.begin(), values.end(), [now](retired_value const& r) {
+            return r.epoch + 2 > now;
+        });
+        std::vector<retired_value> ready;
+        try
+        {
+            ready.assign(waiting_end, values.end());
+        }
+        catch (...)
+        {
+            return ready;
+        }
+        values.erase(waiting_end, values.end());
+        return ready;
+    }
+
+    // Outside of any lock: the destructors may retire values of their own.
+    static void release(std::vector<retired_value> const& ready) noexcept
+    {
+        for (retired_value const& r : ready)
+        {
+            r.cb->release_strong();
+        }
+    }
+
+    // Waits for cb's grace period and drops it, unless self is in a guard.
+    void drop_after_grace(block* cb, participant const* self) noexcept
+    {
+        if (self && self->r->nesting != 0)
+        {
+            return;
+        }
+        std::uint64_t const retired_at = epoch.load();
+        while (epoch.load() < retired_at + 2)
+        {
+            try_advance();
+            std::this_thread::yield();
+        }
+        cb->release_strong();
+    }
+
+    std::atomic<std::uint64_t> epoch{1};
+    detail::record_list<record> records;
+    std::mutex mutex;
+    std::vector<retired_value> orphans;
+};
+
+// Reclaim policy of atomic_shared_ptr that retires replaced values through
+// ebr_domain::global().
+struct ebr_reclaim
+{
+    static void retire(detail::control_block<multi_thread_policy>* cb) noexcept
+    {
+        ebr_domain::global().retire(cb);
+    }
+};
+
+// Pins the calling thread's epoch in ebr_domain::global(): values read
+// through the guard stay alive until it ends. Guards nest. Pinning is a
+// store to the thread's own record and a fence.
+class ebr_guard
+{
+public:
+    ebr_guard()
+        : entry(ebr_domain::this_thread().r)
+    {
+        ebr_domain::global().pin(entry);
+    }
+
+    ebr_guard(ebr_guard const&) = delete;
+    ebr_guard& operator=(ebr_guard const&) = delete;
+
+    ~ebr_guard()
+    {
+        ebr_domain::global().unpin(entry);
+    }
+
+    // Returns the current value of cell, alive until the guard ends,
+    // without touching its reference counts.
+    template <typename T>
+    typename atomic_shared_ptr<T, ebr_reclaim>::value_type::element_type*
+    protect(atomic_shared_ptr<T, ebr_reclaim> const& cell) const noexcept
+    {
+        using element_type = typename atomic_shared_ptr<T, ebr_reclaim>::value_type::element_type;
+        detail::control_block<multi_thread_policy>* const cb = cell.cell.peek();
+        return cb ? static_cast<element_type*>(cb->pointer()) : nullptr;
+    }
+
+private:
+    ebr_domain::record* const entry;
+};
@@ -12,6 +12,7 @@ namespace
 test_object::test_object(int data)
     : data(transcode(data, this))
 {
+    std::lock_guard<std::mutex> lock(mutex);
     auto p = instances.insert(this);
     EXPECT_TRUE(p.second);
 }
@@ -19,6 +20,7 @@ test_object::test_object(int data)
 test_object::test_object(test_object const& other)
 {
     {
+        std::lock_guard<std::mutex> lock(mutex);
         EXPECT_TRUE(instances.find(&other) != instances.end());
         auto p = instances.insert(this);
         EXPECT_TRUE(p.second);
@@ -28,36 +30,47 @@ test_object::test_object(test_object const& other)
 
 test_object::~test_object()
 {
+    std::lock_guard<std::mutex> lock(mutex);
     size_t n = instances.erase(this);
     EXPECT_EQ(1u, n);
 }
 
 test_object& test_object::operator=(test_object const& c)
 {
-    EXPECT_TRUE(instances.find(this) != instances.end());
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        EXPECT_TRUE(instances.find(this) != instances.end());
+    }
     data = transcode(transcode(c.data, &c), this);
     return *this;
 }
 
 test_object::operator int() const
 {
-    EXPECT_TRUE(instances.find(this) != instances.end());
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        EXPECT_TRUE(instances.find(this) != instances.end());
+    }
 
     return transcode(data, this);
 }
 
+std::mutex test_object::mutex;
 std::set<test_object const*> test_object::instances;
 
 test_object::no_new_instances_guard::no_new_instances_guard()
-    : old_instances(instances)
-{}
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    old_instances = instances;
+}
 
 test_object::no_new_instances_guard::~no_new_instances_guard()
 {
-    EXPECT_TRUE(old_instances == instances);
+    expect_no_instances();
 }
 
 void test_object::no_new_instances_guard::expect_no_instances() const
 {
+    std::lock_guard<std::mutex> lock(mutex);
     EXPECT_TRUE(old_instances == instances);
 }
@@ -1,4 +1,5 @@
 #pragma once
+#include <mutex>
 #include <set>
 
 struct test_object
@@ -16,6 +17,8 @@ struct test_object
 private:
     int data;
 
+    // Tests share objects between threads, so instances is locked.
+    static std::mutex mutex;
     static std::set<test_object const*> instances;
 };
 